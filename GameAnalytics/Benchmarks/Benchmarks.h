@@ -0,0 +1,24 @@
+#pragma once
+
+#include <vector>
+#include <chrono>
+
+namespace Benchmarks
+{
+	typedef std::chrono::high_resolution_clock Clock;
+
+	// Sorts the samples, percentile is between 0 and 100
+	long long GetPercentile(std::vector<long long>& samples, double percentile);
+
+	inline long long GetNanoseconds(Clock::duration duration)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+	}
+
+	// Every benchmark prints its own results
+	void ThreadQueue();
+	void EventWriter();
+	void StatementCache();
+	void Durability();
+	void Reclaim();
+}
@@ -0,0 +1,59 @@
+#include "Benchmarks.h"
+
+#include "GameAnalyticsDatabase.h"
+
+#include <cstdio>
+#include <string>
+
+using namespace Benchmarks;
+using namespace Analytics;
+
+namespace
+{
+	const char* const DatabaseFile = "benchmark_durability.db";
+	const int NumEvents = 2000; // Paranoid syncs every commit, which takes milliseconds on some disks
+
+	void MeasureProfile(const char* name, DurabilityProfile::Enum durabilityProfile)
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+		std::vector<long long> samples;
+		samples.reserve(NumEvents);
+		long long totalTime = 0;
+		{
+			GameAnalyticsDatabase database;
+			if (database.Initialize(DatabaseFile, durabilityProfile) != Result::Ok)
+			{
+				printf("  %-9s cannot open the database\n", name);
+				return;
+			}
+
+			const std::string defaultAnnotations = "\"v\":2";
+			const std::string encodedEvent(48, 'x'); // About the size of an encoded design event
+			for (int i = 0; i < NumEvents; ++i)
+			{
+				// Every event is committed on its own, which is the worst case for the events that are queued
+				const Clock::time_point start = Clock::now();
+				database.BeginTransaction();
+				database.AddEvent(defaultAnnotations, 1500000000 + i, encodedEvent, 0);
+				database.CommitTransaction();
+				samples.push_back(GetNanoseconds(Clock::now() - start));
+				totalTime += samples.back();
+			}
+		}
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+		const double commitsPerSecond = NumEvents * 1e9 / totalTime;
+		const long long p99 = GetPercentile(samples, 99.0);
+		printf("  %-9s %8.0f commits/s, p99 %8lld ns\n", name, commitsPerSecond, p99);
+	}
+}
+
+// Throughput and p99 latency of committing single events for every durability profile. The results
+// depend on the disk the database is on, so run it on the hardware the profile is chosen for.
+void Benchmarks::Durability()
+{
+	MeasureProfile("Paranoid", DurabilityProfile::Paranoid);
+	MeasureProfile("Balanced", DurabilityProfile::Balanced);
+	MeasureProfile("Fast", DurabilityProfile::Fast);
+}
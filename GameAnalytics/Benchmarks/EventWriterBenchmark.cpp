@@ -0,0 +1,128 @@
+#include "Benchmarks.h"
+
+#include "EventEncoder.h"
+#include "EventWriter.h"
+
+#include <json/json.h>
+
+#include <cstdio>
+#include <string>
+
+using namespace Benchmarks;
+
+namespace
+{
+	const int NumEvents = 200000;
+
+	// Default annotations as they are sent with every event
+	struct Annotations
+	{
+		std::string device;
+		std::string userId;
+		std::string osVersion;
+		std::string manufacturer;
+		std::string sessionId;
+		int sessionNumber;
+		std::string build;
+	};
+
+	// Path of the first versions: a Json::Value per event, written by Json::FastWriter
+	size_t WriteWithJsonValue(const Annotations& annotations, long long clientTimestamp, float value)
+	{
+		Json::Value event;
+		event["device"] = annotations.device;
+		event["v"] = 2;
+		event["user_id"] = annotations.userId;
+		event["client_ts"] = clientTimestamp;
+		event["sdk_version"] = "rest api v2";
+		event["os_version"] = annotations.osVersion;
+		event["manufacturer"] = annotations.manufacturer;
+		event["platform"] = "windows";
+		event["session_id"] = annotations.sessionId;
+		event["session_num"] = annotations.sessionNumber;
+		event["build"] = annotations.build;
+		event["category"] = "design";
+		event["event_id"] = "GamePlay:Kill:AlienSmurf";
+		event["value"] = value;
+
+		Json::FastWriter writer;
+		return writer.write(event).length();
+	}
+
+	// Encoded when the event is stored, like GameAnalytics::ProcessDesignEvent() does for a registered event id
+	size_t EncodeEvent(Analytics::EventEncoder& encoder, float value)
+	{
+		encoder.Clear();
+		encoder.WriteString("category", "design");
+		encoder.WriteQuotedString("event_id", "\"GamePlay:Kill:AlienSmurf\"");
+		encoder.WriteFloat("value", value);
+		return encoder.GetBuffer().length();
+	}
+
+	// Written when the event is sent, like the event stores do with the stored default annotations and client_ts
+	size_t WriteEncodedEvent(Analytics::EventWriter& writer, const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent)
+	{
+		writer.Clear();
+		writer.BeginObject();
+		writer.WriteMembers(defaultAnnotations);
+		writer.WriteInt("client_ts", clientTimestamp);
+		if (!Analytics::EventEncoder::WriteJson(encodedEvent.data(), encodedEvent.size(), 0, writer))
+			return 0;
+		writer.EndObject();
+		return writer.GetBuffer().length();
+	}
+}
+
+// Time to get from a design event to its json with its default annotations
+void Benchmarks::EventWriter()
+{
+	Annotations annotations;
+	annotations.device = "unknown";
+	annotations.userId = "76561197960287930";
+	annotations.osVersion = "windows 10.0.14393";
+	annotations.manufacturer = "unknown";
+	annotations.sessionId = "de305d54-75b4-431b-adb2-eb6b9e546014";
+	annotations.sessionNumber = 3;
+	annotations.build = "v1.0.0";
+
+	Analytics::EventWriter writer;
+	writer.BeginObject();
+	writer.WriteString("device", annotations.device);
+	writer.WriteInt("v", 2);
+	writer.WriteString("user_id", annotations.userId);
+	writer.WriteString("sdk_version", "rest api v2");
+	writer.WriteString("os_version", annotations.osVersion);
+	writer.WriteString("manufacturer", annotations.manufacturer);
+	writer.WriteString("platform", "windows");
+	writer.WriteString("session_id", annotations.sessionId);
+	writer.WriteInt("session_num", annotations.sessionNumber);
+	writer.WriteString("build", annotations.build);
+	writer.EndObject();
+	const std::string defaultAnnotations = writer.GetMembers();
+
+	// The lengths are summed so the writes can't be optimized away
+	size_t totalLength = 0;
+	Clock::time_point start = Clock::now();
+	for (int i = 0; i < NumEvents; ++i)
+		totalLength += WriteWithJsonValue(annotations, 1500000000 + i, (float)i);
+	const long long jsonValueTime = GetNanoseconds(Clock::now() - start);
+
+	// Every event is encoded once and written once, the same encoded event is written to keep the store out of the measurement
+	Analytics::EventEncoder encoder;
+	start = Clock::now();
+	for (int i = 0; i < NumEvents; ++i)
+		totalLength += EncodeEvent(encoder, (float)i);
+	const long long encodeTime = GetNanoseconds(Clock::now() - start);
+
+	const std::string encodedEvent = encoder.GetBuffer();
+	start = Clock::now();
+	for (int i = 0; i < NumEvents; ++i)
+		totalLength += WriteEncodedEvent(writer, defaultAnnotations, 1500000000 + i, encodedEvent);
+	const long long writeTime = GetNanoseconds(Clock::now() - start);
+
+	printf("  Json::Value             %6lld ns per event\n", jsonValueTime / NumEvents);
+	printf("  EventEncoder            %6lld ns per event\n", encodeTime / NumEvents);
+	printf("  EventEncoder::WriteJson %6lld ns per event\n", writeTime / NumEvents);
+	printf("  EventEncoder total      %6lld ns per event\n", (encodeTime + writeTime) / NumEvents);
+	printf("  (%u bytes written)\n", (unsigned int)totalLength);
+}
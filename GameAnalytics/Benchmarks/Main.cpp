@@ -0,0 +1,53 @@
+#include "Benchmarks.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace
+{
+	struct Benchmark
+	{
+		const char* name;
+		void (*function)();
+	};
+
+	const Benchmark benchmarks[] =
+	{
+		{ "ThreadQueue", &Benchmarks::ThreadQueue },
+		{ "EventWriter", &Benchmarks::EventWriter },
+		{ "StatementCache", &Benchmarks::StatementCache },
+		{ "Durability", &Benchmarks::Durability },
+		{ "Reclaim", &Benchmarks::Reclaim },
+	};
+}
+
+long long Benchmarks::GetPercentile(std::vector<long long>& samples, double percentile)
+{
+	if (samples.empty())
+		return 0;
+
+	const size_t index = std::min(samples.size() - 1, (size_t)(samples.size() * percentile / 100.0));
+	std::nth_element(samples.begin(), samples.begin() + index, samples.end());
+	return samples[index];
+}
+
+// Runs all benchmarks, or only the ones that are named on the command line
+int main(int argc, char* argv[])
+{
+	for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); ++i)
+	{
+		bool isSelected = (argc <= 1);
+		for (int arg = 1; arg < argc; ++arg)
+			isSelected = isSelected || (strcmp(argv[arg], benchmarks[i].name) == 0);
+
+		if (!isSelected)
+			continue;
+
+		printf("%s\n", benchmarks[i].name);
+		benchmarks[i].function();
+		printf("\n");
+	}
+
+	return 0;
+}
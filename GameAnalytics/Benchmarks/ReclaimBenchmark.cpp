@@ -0,0 +1,96 @@
+#include "Benchmarks.h"
+
+#include "GameAnalyticsDatabase.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string>
+
+using namespace Benchmarks;
+using namespace Analytics;
+
+namespace
+{
+	const char* const DatabaseFile = "benchmark_reclaim.db";
+	const int NumEvents = 50000;
+	const int BatchSize = 1000;
+	const std::chrono::milliseconds TimeSlice(2); // Default of InitData::reclaimTimeSlice
+
+	// Stores events and deletes them again as if they were sent, which leaves free pages behind
+	bool FreePages(GameAnalyticsDatabase& database, const std::string& defaultAnnotations)
+	{
+		const std::string encodedEvent(200, 'x');
+
+		database.BeginTransaction();
+		for (int i = 0; i < NumEvents; ++i)
+			database.AddEvent(defaultAnnotations, 1500000000 + i, encodedEvent, 0);
+		if (!database.CommitTransaction())
+			return false;
+
+		for (int i = 0; i < NumEvents / BatchSize; ++i)
+		{
+			if (!database.LeaseEvents(1, BatchSize) || !database.DeleteLeasedEvents(1))
+				return false;
+		}
+
+		return true;
+	}
+
+	// Reclaims in slices like the analytics thread does while idle, with an event stored in between
+	void MeasureProfile(const char* name, DurabilityProfile::Enum durabilityProfile)
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+		{
+			GameAnalyticsDatabase database;
+			const std::string defaultAnnotations = "\"v\":2";
+			int numFreePages = 0;
+			if (database.Initialize(DatabaseFile, durabilityProfile) != Result::Ok || !database.CanReclaimFreePages() ||
+				!FreePages(database, defaultAnnotations) || !database.GetNumFreePages(numFreePages))
+			{
+				printf("  %-9s cannot free pages\n", name);
+				return;
+			}
+
+			const int numFreedPages = numFreePages;
+			std::vector<long long> stepSamples;
+			long long longestSlice = 0;
+			int numSlices = 0;
+			while (numFreePages > 0)
+			{
+				const Clock::time_point sliceStart = Clock::now();
+				do
+				{
+					const int numPreviousFreePages = numFreePages;
+					const Clock::time_point stepStart = Clock::now();
+					if (!database.ReclaimFreePages(numFreePages) || numFreePages >= numPreviousFreePages)
+					{
+						printf("  %-9s cannot reclaim pages\n", name);
+						return;
+					}
+					stepSamples.push_back(GetNanoseconds(Clock::now() - stepStart));
+				} while (numFreePages > 0 && Clock::now() - sliceStart < TimeSlice);
+
+				longestSlice = std::max(longestSlice, GetNanoseconds(Clock::now() - sliceStart));
+				++numSlices;
+
+				database.BeginTransaction();
+				database.AddEvent(defaultAnnotations, 1500000000, "event", 0);
+				database.CommitTransaction();
+			}
+
+			const long long p50 = GetPercentile(stepSamples, 50.0);
+			const long long maxStep = GetPercentile(stepSamples, 100.0);
+			printf("  %-9s %d pages in %d slices: step p50 %lld ns, max %lld ns, longest slice %lld ns\n", name, numFreedPages, numSlices, p50, maxStep, longestSlice);
+		}
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+	}
+}
+
+// Time spent reclaiming the free pages of sent events for every durability profile. The longest slice is
+// how long an event that is queued while the analytics thread is idle can wait for it.
+void Benchmarks::Reclaim()
+{
+	MeasureProfile("Paranoid", DurabilityProfile::Paranoid);
+	MeasureProfile("Balanced", DurabilityProfile::Balanced);
+	MeasureProfile("Fast", DurabilityProfile::Fast);
+}
@@ -0,0 +1,95 @@
+#include "Benchmarks.h"
+
+#include "GameAnalyticsDatabase.h"
+
+#include <sqlite/sqlite3.h>
+
+#include <cstdio>
+#include <string>
+
+using namespace Benchmarks;
+using namespace Analytics;
+
+namespace
+{
+	const char* const DatabaseFile = "benchmark_statements.db";
+	const int NumEvents = 100000;
+
+	// The first versions prepared the insert for every event and finalized it again
+	bool AddEventWithNewStatement(sqlite3* database, const std::string& encodedEvent, long long clientTimestamp)
+	{
+		sqlite3_stmt* statement = NULL;
+		int rc = sqlite3_prepare_v2(database, "INSERT INTO `events` (`annotations_id`, `data`, `client_ts`, `priority`) VALUES(?, ?, ?, ?);", -1, &statement, NULL);
+		if (rc != SQLITE_OK)
+			return false;
+
+		sqlite3_bind_int64(statement, 1, 1);
+		sqlite3_bind_blob(statement, 2, encodedEvent.data(), (int)encodedEvent.size(), NULL);
+		sqlite3_bind_int64(statement, 3, clientTimestamp);
+		sqlite3_bind_int(statement, 4, 0);
+
+		rc = sqlite3_step(statement);
+		sqlite3_finalize(statement);
+		return (rc == SQLITE_DONE);
+	}
+
+	// Inserts in one transaction, so the time is spent on the statements instead of on syncing
+	double MeasureNewStatements(const std::string& encodedEvent)
+	{
+		// Let the database create its tables first
+		{
+			GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+			GameAnalyticsDatabase database;
+			if (database.Initialize(DatabaseFile, DurabilityProfile::Balanced) != Result::Ok)
+				return 0.0;
+		}
+
+		sqlite3* database = NULL;
+		if (sqlite3_open(DatabaseFile, &database) != SQLITE_OK)
+			return 0.0;
+
+		const Clock::time_point start = Clock::now();
+		sqlite3_exec(database, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+		for (int i = 0; i < NumEvents; ++i)
+			AddEventWithNewStatement(database, encodedEvent, 1500000000 + i);
+		sqlite3_exec(database, "COMMIT TRANSACTION;", NULL, NULL, NULL);
+		const long long time = GetNanoseconds(Clock::now() - start);
+
+		sqlite3_close(database);
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+		return NumEvents * 1e9 / time;
+	}
+
+	double MeasureCachedStatements(const std::string& encodedEvent)
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+		long long time = 0;
+		{
+			GameAnalyticsDatabase database;
+			if (database.Initialize(DatabaseFile, DurabilityProfile::Balanced) != Result::Ok)
+				return 0.0;
+
+			const std::string defaultAnnotations = "\"v\":2";
+			const Clock::time_point start = Clock::now();
+			database.BeginTransaction();
+			for (int i = 0; i < NumEvents; ++i)
+				database.AddEvent(defaultAnnotations, 1500000000 + i, encodedEvent, 0);
+			database.CommitTransaction();
+			time = GetNanoseconds(Clock::now() - start);
+		}
+
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+		return NumEvents * 1e9 / time;
+	}
+}
+
+// Events inserted per second when every insert prepares its statement and with the statements that
+// GameAnalyticsDatabase prepares once
+void Benchmarks::StatementCache()
+{
+	const std::string encodedEvent(48, 'x'); // About the size of an encoded design event
+
+	printf("  prepared per insert  %8.0f events/s\n", MeasureNewStatements(encodedEvent));
+	printf("  cached statement     %8.0f events/s\n", MeasureCachedStatements(encodedEvent));
+}
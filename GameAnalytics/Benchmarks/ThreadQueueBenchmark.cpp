@@ -0,0 +1,161 @@
+#include "Benchmarks.h"
+
+#include "GameAnalytics.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+using namespace Benchmarks;
+
+namespace
+{
+	const size_t NumCallsPerProducer = 50000;
+	const size_t QueueCapacity = 8192;
+	const char* const DatabaseFile = "thread_queue_benchmark.db";
+
+	// Queue of the first versions, every push takes the mutex and notifies the consumer
+	class MutexQueue
+	{
+	public:
+		void Push(std::function<void()> func)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			functions.push(std::move(func));
+			condition.notify_one();
+		}
+
+		// Takes all queued functions at once, like the thread did
+		bool Pop(std::queue< std::function<void()> >& outFunctions, const std::atomic<bool>& isDone)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			condition.wait(lock, [&] { return !functions.empty() || isDone; });
+			outFunctions.swap(functions);
+			return !outFunctions.empty();
+		}
+
+		void Stop()
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			condition.notify_one();
+		}
+
+	private:
+		std::mutex mutex;
+		std::condition_variable condition;
+		std::queue< std::function<void()> > functions;
+	};
+
+	// Calls are timed one by one, so waiting for room in a full queue counts towards the latency
+	template<typename Func>
+	void RunProducer(Func call, std::vector<long long>& outSamples)
+	{
+		outSamples.reserve(NumCallsPerProducer);
+		for (size_t i = 0; i < NumCallsPerProducer; ++i)
+		{
+			const Clock::time_point start = Clock::now();
+			call();
+			outSamples.push_back(GetNanoseconds(Clock::now() - start));
+		}
+	}
+
+	template<typename Func>
+	void RunProducers(int numProducers, Func call, std::vector< std::vector<long long> >& outSamples)
+	{
+		outSamples.assign(numProducers, std::vector<long long>());
+		std::vector<std::thread> producers;
+		for (int i = 0; i < numProducers; ++i)
+		{
+			std::vector<long long>& producerSamples = outSamples[i];
+			producers.push_back(std::thread([&call, &producerSamples] { RunProducer(call, producerSamples); }));
+		}
+		for (size_t i = 0; i < producers.size(); ++i)
+			producers[i].join();
+	}
+
+	void PrintLatency(const char* name, int numProducers, std::vector< std::vector<long long> >& samples)
+	{
+		std::vector<long long> allSamples;
+		for (size_t i = 0; i < samples.size(); ++i)
+			allSamples.insert(allSamples.end(), samples[i].begin(), samples[i].end());
+
+		const long long p50 = GetPercentile(allSamples, 50.0);
+		const long long p99 = GetPercentile(allSamples, 99.0);
+		printf("  %-21s %2d producers: p50 %6lld ns, p99 %8lld ns\n", name, numProducers, p50, p99);
+	}
+
+	void MeasureMutexQueue(int numProducers)
+	{
+		MutexQueue queue;
+		std::atomic<bool> isDone(false);
+		std::thread consumer([&] {
+			std::queue< std::function<void()> > functions;
+			while (queue.Pop(functions, isDone) || !isDone)
+			{
+				for (; !functions.empty(); functions.pop())
+					functions.front()();
+			}
+		});
+
+		// Captures a single pointer, like the functions that are queued by GameAnalytics, so creating it doesn't allocate
+		std::atomic<size_t> numCalls(0);
+		std::vector< std::vector<long long> > samples;
+		RunProducers(numProducers, [&queue, &numCalls] {
+			queue.Push([&numCalls] { ++numCalls; });
+		}, samples);
+
+		isDone = true;
+		queue.Stop();
+		consumer.join();
+
+		PrintLatency("mutex queue", numProducers, samples);
+	}
+
+	// Goes through GameAnalytics itself, so the analytics thread stores the events in a database like it does in a game
+	void MeasureGameAnalytics(int numProducers)
+	{
+		Analytics::GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+		std::vector< std::vector<long long> > eventSamples;
+		std::vector< std::vector<long long> > functionSamples;
+		{
+			Analytics::GameAnalytics analytics("benchmark_secret_key", "benchmark_game_key");
+			Analytics::GameAnalytics::InitData initData;
+			initData.databaseFileName = DatabaseFile;
+			initData.eventQueueCapacity = QueueCapacity;
+			analytics.Init(initData);
+
+			const Analytics::EventHandle eventId = analytics.RegisterEventId("GamePlay:Kill:AlienSmurf");
+			RunProducers(numProducers, [&analytics, eventId] {
+				analytics.SendDesignEvent(eventId);
+			}, eventSamples);
+
+			std::atomic<size_t> numCalls(0);
+			RunProducers(numProducers, [&analytics, &numCalls] {
+				analytics.QueueFunctionToThread([&numCalls] { ++numCalls; });
+			}, functionSamples);
+
+			analytics.DeinitializeAndWaitForThread();
+		}
+		Analytics::GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+		PrintLatency("SendDesignEvent", numProducers, eventSamples);
+		PrintLatency("QueueFunctionToThread", numProducers, functionSamples);
+	}
+}
+
+// Latency of handing work to the analytics thread: a design event sent by handle and a queued function, next to
+// the mutex queue that the first versions used for everything
+void Benchmarks::ThreadQueue()
+{
+	const int producerCounts[] = { 1, 4, 16 };
+	for (size_t i = 0; i < sizeof(producerCounts) / sizeof(producerCounts[0]); ++i)
+	{
+		MeasureMutexQueue(producerCounts[i]);
+		MeasureGameAnalytics(producerCounts[i]);
+	}
+}
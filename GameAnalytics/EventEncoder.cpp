@@ -0,0 +1,261 @@
+#include "EventEncoder.h"
+
+#include "EventWriter.h"
+
+#include <assert.h>
+#include <string.h>
+
+using namespace Analytics;
+
+namespace
+{
+	struct FieldType
+	{
+		enum Enum
+		{
+			Int,			// Zigzag varint
+			Float,			// 4 bytes
+			String,			// Varint length, followed by the characters
+			QuotedString,	// Varint length, followed by the quoted and escaped json string
+		};
+	};
+
+	// The index of a key is stored in the database, so keys can only be added at the end.
+	// Index 0 means the key itself follows the field type, for keys that are not in this list.
+	const char* const knownKeys[] =
+	{
+		"",
+		"category",
+		"client_ts",
+		"event_id",
+		"value",
+		"score",
+		"attempt_num",
+		"length",
+	};
+
+	const unsigned char ClientTimestampKey = 2;
+	const unsigned char NumKnownKeys = sizeof(knownKeys) / sizeof(knownKeys[0]);
+	const unsigned char KeyMask = 0x1F;
+	const int TypeShift = 5;
+
+	unsigned char FindKey(const char* key)
+	{
+		for (unsigned char i = 1; i < NumKnownKeys; ++i)
+		{
+			if (strcmp(knownKeys[i], key) == 0)
+				return i;
+		}
+		return 0;
+	}
+
+	bool ReadVarint(const char*& current, const char* end, unsigned long long& outValue)
+	{
+		outValue = 0;
+		for (int shift = 0; current != end && shift < 64; shift += 7)
+		{
+			const unsigned char byte = (unsigned char)*current++;
+			outValue |= (unsigned long long)(byte & 0x7F) << shift;
+			if ((byte & 0x80) == 0)
+				return true;
+		}
+		return false;
+	}
+
+	bool ReadBytes(const char*& current, const char* end, const char*& outBytes, size_t& outLength)
+	{
+		unsigned long long length;
+		if (!ReadVarint(current, end, length) || length > (unsigned long long)(end - current))
+			return false;
+
+		outBytes = current;
+		outLength = (size_t)length;
+		current += outLength;
+		return true;
+	}
+}
+
+EventEncoder::EventEncoder() :
+	stringStart(0)
+{
+}
+
+void EventEncoder::Clear()
+{
+	buffer.clear();
+}
+
+void EventEncoder::WriteString(const char* key, const char* value)
+{
+	WriteField(key, FieldType::String);
+	WriteBytes(value, strlen(value));
+}
+
+void EventEncoder::WriteString(const char* key, const std::string& value)
+{
+	WriteField(key, FieldType::String);
+	WriteBytes(value.c_str(), value.length());
+}
+
+void EventEncoder::WriteInt(const char* key, long long value)
+{
+	WriteField(key, FieldType::Int);
+
+	// Zigzag, so small negative numbers stay small too
+	AppendVarint(buffer, ((unsigned long long)value << 1) ^ (unsigned long long)(value >> 63));
+}
+
+void EventEncoder::WriteFloat(const char* key, float value)
+{
+	WriteField(key, FieldType::Float);
+
+	// The database never leaves the machine, so the byte order doesn't matter
+	char bytes[sizeof(float)];
+	memcpy(bytes, &value, sizeof(float));
+	buffer.append(bytes, sizeof(float));
+}
+
+void EventEncoder::WriteQuotedString(const char* key, const std::string& quotedValue)
+{
+	assert(quotedValue.length() >= 2 && quotedValue.front() == '"' && quotedValue.back() == '"');
+
+	WriteField(key, FieldType::QuotedString);
+	WriteBytes(quotedValue.c_str(), quotedValue.length());
+}
+
+void EventEncoder::WriteQuotedString(const char* key, const char* quotedValue)
+{
+	assert(quotedValue[0] == '"');
+
+	WriteField(key, FieldType::QuotedString);
+	WriteBytes(quotedValue, strlen(quotedValue));
+}
+
+void EventEncoder::BeginString(const char* key)
+{
+	WriteField(key, FieldType::String);
+	stringStart = buffer.length();
+}
+
+void EventEncoder::AppendToString(const char* value)
+{
+	buffer += value;
+}
+
+void EventEncoder::EndString()
+{
+	assert(stringStart <= buffer.length());
+
+	// The length is only known now, it is almost always a single byte so inserting it is cheap
+	std::string length;
+	AppendVarint(length, buffer.length() - stringStart);
+	buffer.insert(stringStart, length);
+}
+
+const std::string& EventEncoder::GetBuffer() const
+{
+	return buffer;
+}
+
+bool EventEncoder::WriteJson(const char* data, size_t size, long long clientTimestampOffset, EventWriter& outWriter)
+{
+	std::string unknownKey;
+
+	const char* current = data;
+	const char* end = data + size;
+	while (current != end)
+	{
+		const unsigned char field = (unsigned char)*current++;
+		const unsigned char keyIndex = field & KeyMask;
+		if (keyIndex >= NumKnownKeys)
+			return false;
+
+		const char* key = knownKeys[keyIndex];
+		if (keyIndex == 0)
+		{
+			const char* keyBytes;
+			size_t keyLength;
+			if (!ReadBytes(current, end, keyBytes, keyLength))
+				return false;
+
+			unknownKey.assign(keyBytes, keyLength);
+			key = unknownKey.c_str();
+		}
+
+		switch (field >> TypeShift)
+		{
+		case FieldType::Int:
+		{
+			unsigned long long encoded;
+			if (!ReadVarint(current, end, encoded))
+				return false;
+
+			long long value = (long long)(encoded >> 1) ^ -(long long)(encoded & 1);
+			if (keyIndex == ClientTimestampKey)
+				value += clientTimestampOffset;
+			outWriter.WriteInt(key, value);
+			break;
+		}
+
+		case FieldType::Float:
+		{
+			if ((size_t)(end - current) < sizeof(float))
+				return false;
+
+			float value;
+			memcpy(&value, current, sizeof(float));
+			current += sizeof(float);
+			outWriter.WriteFloat(key, value);
+			break;
+		}
+
+		case FieldType::String:
+		case FieldType::QuotedString:
+		{
+			const char* value;
+			size_t length;
+			if (!ReadBytes(current, end, value, length))
+				return false;
+
+			if ((field >> TypeShift) == FieldType::String)
+				outWriter.WriteString(key, value, length);
+			else
+				outWriter.WriteQuotedString(key, value, length);
+			break;
+		}
+
+		default:
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void EventEncoder::WriteField(const char* key, unsigned char type)
+{
+	const unsigned char keyIndex = FindKey(key);
+	buffer += (char)((type << TypeShift) | keyIndex);
+
+	if (keyIndex == 0)
+	{
+		assert(false); // Add the key to knownKeys, so it isn't stored with every event
+		WriteBytes(key, strlen(key));
+	}
+}
+
+void EventEncoder::WriteBytes(const char* value, size_t length)
+{
+	AppendVarint(buffer, length);
+	buffer.append(value, length);
+}
+
+void EventEncoder::AppendVarint(std::string& outBuffer, unsigned long long value)
+{
+	while (value >= 0x80)
+	{
+		outBuffer += (char)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	outBuffer += (char)value;
+}
\ No newline at end of file
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+
+namespace Analytics
+{
+	class EventWriter;
+
+	// Encodes the fields of an event into the compact rows of the event database, they are turned into json
+	// by WriteJson() when the event is sent. Every field starts with a byte that holds its type and the index
+	// of its key, numbers are stored as varints and strings are stored as they are, without escaping.
+	class EventEncoder
+	{
+	public:
+		EventEncoder();
+
+		// Keeps the allocated memory of the buffer around for the next event
+		void Clear();
+
+		void WriteString(const char* key, const char* value);
+		void WriteString(const char* key, const std::string& value);
+		void WriteInt(const char* key, long long value);
+		void WriteFloat(const char* key, float value);
+
+		// Value has to be quoted and escaped already, it is copied into the json as it is
+		void WriteQuotedString(const char* key, const std::string& quotedValue);
+		void WriteQuotedString(const char* key, const char* quotedValue);
+
+		// Writes a string value in parts, so it doesn't have to be concatenated first
+		void BeginString(const char* key);
+		void AppendToString(const char* value);
+		void EndString();
+
+		const std::string& GetBuffer() const;
+
+		// Writes the encoded fields as members of the object in outWriter, client_ts is moved by clientTimestampOffset.
+		// Fails when the data was not written by an EventEncoder.
+		static bool WriteJson(const char* data, size_t size, long long clientTimestampOffset, EventWriter& outWriter);
+
+	private:
+		void WriteField(const char* key, unsigned char type);
+		void WriteBytes(const char* value, size_t length);
+		static void AppendVarint(std::string& outBuffer, unsigned long long value);
+
+		std::string buffer;
+		size_t stringStart; // Where the string of BeginString() starts
+	};
+}
\ No newline at end of file
@@ -0,0 +1,70 @@
+#include "EventIdRegistry.h"
+#include "EventSchema.h"
+#include "EventWriter.h"
+
+#include <assert.h>
+
+using namespace Analytics;
+
+EventIdRegistry::EventIdRegistry() :
+	entries(new const Entry*[MaxEventIds]),
+	numEntries(0)
+{
+}
+
+EventIdRegistry::~EventIdRegistry()
+{
+	const unsigned int count = numEntries.load(std::memory_order_acquire);
+	for (unsigned int i = 0; i < count; ++i)
+		delete entries[i];
+}
+
+EventHandle EventIdRegistry::Register(const std::string& eventId)
+{
+	std::lock_guard<std::mutex> lock(registerMutex);
+
+	auto itr = lookup.find(eventId);
+	if (itr != lookup.end())
+		return EventHandle(itr->second);
+
+	const unsigned int id = numEntries.load(std::memory_order_relaxed);
+	if (id >= MaxEventIds)
+	{
+		assert(false); // Too many event ids registered
+		return EventHandle();
+	}
+
+	Entry* entry = new Entry();
+	entry->eventId = eventId;
+	EventWriter::AppendQuoted(entry->quotedEventId, eventId.c_str());
+	entry->isProgressionEventId = EventSchema::IsValidProgressionEventId(eventId.c_str());
+	entries[id] = entry;
+	lookup[eventId] = id;
+
+	// Publish the entry, readers only look at entries below numEntries
+	numEntries.store(id + 1, std::memory_order_release);
+	return EventHandle(id);
+}
+
+bool EventIdRegistry::IsValid(EventHandle handle) const
+{
+	return (handle.id < numEntries.load(std::memory_order_acquire));
+}
+
+bool EventIdRegistry::IsProgressionEventId(EventHandle handle) const
+{
+	assert(IsValid(handle));
+	return entries[handle.id]->isProgressionEventId;
+}
+
+const std::string& EventIdRegistry::GetEventId(EventHandle handle) const
+{
+	assert(IsValid(handle));
+	return entries[handle.id]->eventId;
+}
+
+const std::string& EventIdRegistry::GetQuotedEventId(EventHandle handle) const
+{
+	assert(IsValid(handle));
+	return entries[handle.id]->quotedEventId;
+}
\ No newline at end of file
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <unordered_map>
+
+namespace Analytics
+{
+	struct EventHandle
+	{
+		static const unsigned int InvalidId = 0xFFFFFFFF;
+
+		EventHandle() : id(InvalidId) {}
+		explicit EventHandle(unsigned int id) : id(id) {}
+
+		unsigned int id;
+	};
+
+	// Keeps every registered event id alive for the lifetime of the registry, so
+	// a handle can be sent around instead of copying the string for every event.
+	// Registering takes a lock, looking up a handle does not.
+	class EventIdRegistry
+	{
+	public:
+		static const unsigned int MaxEventIds = 4096;
+
+		EventIdRegistry();
+		~EventIdRegistry();
+
+		// Registering the same id twice returns the same handle
+		EventHandle Register(const std::string& eventId);
+
+		bool IsValid(EventHandle handle) const;
+
+		// Progression events allow less parts than design events
+		bool IsProgressionEventId(EventHandle handle) const;
+		const std::string& GetEventId(EventHandle handle) const;
+
+		// Event id already quoted and escaped for json, so it can be written without looking at it again
+		const std::string& GetQuotedEventId(EventHandle handle) const;
+
+	private:
+		struct Entry
+		{
+			std::string eventId;
+			std::string quotedEventId;
+			bool isProgressionEventId;
+		};
+
+		std::unique_ptr<const Entry*[]> entries;
+		std::atomic<unsigned int> numEntries;
+
+		std::mutex registerMutex;
+		std::unordered_map<std::string, unsigned int> lookup; // Only accessed while holding registerMutex
+
+		EventIdRegistry(const EventIdRegistry&);
+		EventIdRegistry& operator=(const EventIdRegistry&);
+	};
+}
\ No newline at end of file
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stddef.h>
+
+// Checks the event id at compile time and fails to build when it doesn't follow the GameAnalytics rules.
+// Id has to be a string literal, usage: static const StaticDesignEventId killedSmurf = GA_DESIGN_EVENT_ID("GamePlay:Kill:AlienSmurf");
+#define GA_DESIGN_EVENT_ID(eventId) \
+	Analytics::EventSchema::ValidatedEventId<Analytics::EventSchema::IsValidDesignEventId(eventId)>::MakeDesign(eventId, "\"" eventId "\"")
+
+// Usage: static const StaticProgressionEventId level1 = GA_PROGRESSION_EVENT_ID("Campaign:Level1");
+#define GA_PROGRESSION_EVENT_ID(eventId) \
+	Analytics::EventSchema::ValidatedEventId<Analytics::EventSchema::IsValidProgressionEventId(eventId)>::MakeProgression(eventId, "\"Start:" eventId "\"", "\"Fail:" eventId "\"", "\"Complete:" eventId "\"")
+
+namespace Analytics
+{
+	// Event ids that are checked at compile time, made with GA_DESIGN_EVENT_ID() and GA_PROGRESSION_EVENT_ID().
+	// The quoted ids are written to the event as is, valid ids never need escaping.
+	struct StaticDesignEventId
+	{
+		constexpr StaticDesignEventId(const char* eventId, const char* quotedEventId) : eventId(eventId), quotedEventId(quotedEventId) {}
+
+		const char* eventId;
+		const char* quotedEventId;
+	};
+
+	struct StaticProgressionEventId
+	{
+		constexpr StaticProgressionEventId(const char* eventId, const char* quotedStartEventId, const char* quotedFailEventId, const char* quotedCompleteEventId) :
+			eventId(eventId), quotedStartEventId(quotedStartEventId), quotedFailEventId(quotedFailEventId), quotedCompleteEventId(quotedCompleteEventId) {}
+
+		const char* eventId; // Without the status
+		const char* quotedStartEventId;
+		const char* quotedFailEventId;
+		const char* quotedCompleteEventId;
+	};
+
+	// Rules of the GameAnalytics collector, also usable at runtime
+	namespace EventSchema
+	{
+		static const unsigned int MaxPartLength = 64;
+		static const unsigned int MaxDesignEventParts = 5;
+		static const unsigned int MaxProgressionEventParts = 3;
+
+		// Longest design event id, with the separators between its parts. Progression event ids are shorter.
+		static const unsigned int MaxEventIdLength = MaxDesignEventParts * MaxPartLength + (MaxDesignEventParts - 1);
+
+		constexpr bool IsValidCharacter(char character)
+		{
+			return (character >= 'a' && character <= 'z') || (character >= 'A' && character <= 'Z') || (character >= '0' && character <= '9') ||
+				character == ' ' || character == '-' || character == '_' || character == '.' || character == '(' || character == ')' || character == '!' || character == '?';
+		}
+
+		// Written as a single return statement, so it can be evaluated at compile time with C++11 constexpr
+		constexpr bool IsValidEventIdPart(const char* eventId, unsigned int maxParts, unsigned int numParts, unsigned int partLength)
+		{
+			return (*eventId == '\0') ? (partLength > 0) :
+				(*eventId == ':') ? (partLength > 0 && numParts < maxParts && IsValidEventIdPart(eventId + 1, maxParts, numParts + 1, 0)) :
+				(IsValidCharacter(*eventId) && partLength < MaxPartLength && IsValidEventIdPart(eventId + 1, maxParts, numParts, partLength + 1));
+		}
+
+		constexpr bool IsValidEventId(const char* eventId, unsigned int maxParts)
+		{
+			return (eventId != nullptr) && IsValidEventIdPart(eventId, maxParts, 1, 0);
+		}
+
+		constexpr bool IsValidDesignEventId(const char* eventId)
+		{
+			return IsValidEventId(eventId, MaxDesignEventParts);
+		}
+
+		// Without the status, that is added when the event is sent
+		constexpr bool IsValidProgressionEventId(const char* eventId)
+		{
+			return IsValidEventId(eventId, MaxProgressionEventParts);
+		}
+
+		template<bool IsValid>
+		struct ValidatedEventId
+		{
+			static_assert(IsValid, "Event id doesn't follow the GameAnalytics rules: 1 to 5 parts for design events, 1 to 3 parts for progression events, separated by ':'. "
+				"Every part has 1 to 64 characters from [A-Za-z0-9 -_.()!?]");
+
+			static constexpr StaticDesignEventId MakeDesign(const char* eventId, const char* quotedEventId)
+			{
+				return StaticDesignEventId(eventId, quotedEventId);
+			}
+
+			static constexpr StaticProgressionEventId MakeProgression(const char* eventId, const char* quotedStartEventId, const char* quotedFailEventId, const char* quotedCompleteEventId)
+			{
+				return StaticProgressionEventId(eventId, quotedStartEventId, quotedFailEventId, quotedCompleteEventId);
+			}
+		};
+	}
+}
\ No newline at end of file
@@ -0,0 +1,206 @@
+#include "EventWriter.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <cmath>
+
+using namespace Analytics;
+
+EventWriter::EventWriter() :
+	hasMembers(false)
+{
+}
+
+void EventWriter::Clear()
+{
+	buffer.clear();
+	hasMembers = false;
+}
+
+void EventWriter::BeginObject()
+{
+	assert(buffer.empty()); // Only flat objects are supported
+	buffer += '{';
+	hasMembers = false;
+}
+
+void EventWriter::EndObject()
+{
+	buffer += '}';
+}
+
+void EventWriter::WriteString(const char* key, const char* value)
+{
+	WriteKey(key);
+	AppendQuoted(buffer, value);
+}
+
+void EventWriter::WriteString(const char* key, const std::string& value)
+{
+	WriteString(key, value.c_str(), value.length());
+}
+
+void EventWriter::WriteString(const char* key, const char* value, size_t length)
+{
+	WriteKey(key);
+	buffer += '"';
+	AppendEscaped(buffer, value, value + length);
+	buffer += '"';
+}
+
+void EventWriter::WriteInt(const char* key, long long value)
+{
+	WriteKey(key);
+
+	char digits[24];
+	char* current = digits + sizeof(digits);
+	unsigned long long remaining = (value < 0) ? (0ull - (unsigned long long)value) : (unsigned long long)value;
+	do
+	{
+		*--current = (char)('0' + (remaining % 10));
+		remaining /= 10;
+	} while (remaining != 0);
+	if (value < 0)
+		*--current = '-';
+
+	buffer.append(current, digits + sizeof(digits));
+}
+
+void EventWriter::WriteFloat(const char* key, float value)
+{
+	WriteKey(key);
+
+	if (!std::isfinite(value))
+	{
+		assert(false); // Json has no way to write inf or nan
+		buffer += '0';
+		return;
+	}
+
+	// 9 significant digits are enough to get the exact same float back
+	char digits[32];
+	int length = snprintf(digits, sizeof(digits), "%.9g", value);
+	assert(length > 0 && length < (int)sizeof(digits));
+
+	// Don't depend on the locale for the decimal separator
+	for (int i = 0; i < length; ++i)
+	{
+		if (digits[i] == ',')
+			digits[i] = '.';
+	}
+
+	buffer.append(digits, length);
+}
+
+void EventWriter::WriteQuotedString(const char* key, const std::string& quotedValue)
+{
+	assert(quotedValue.length() >= 2 && quotedValue.front() == '"' && quotedValue.back() == '"');
+
+	WriteKey(key);
+	buffer += quotedValue;
+}
+
+void EventWriter::WriteQuotedString(const char* key, const char* quotedValue)
+{
+	assert(quotedValue[0] == '"');
+
+	WriteKey(key);
+	buffer += quotedValue;
+}
+
+void EventWriter::WriteQuotedString(const char* key, const char* quotedValue, size_t length)
+{
+	assert(length >= 2 && quotedValue[0] == '"' && quotedValue[length - 1] == '"');
+
+	WriteKey(key);
+	buffer.append(quotedValue, length);
+}
+
+void EventWriter::WriteMembers(const std::string& members)
+{
+	if (members.empty())
+		return;
+
+	if (hasMembers)
+		buffer += ',';
+	buffer += members;
+	hasMembers = true;
+}
+
+const std::string& EventWriter::GetBuffer() const
+{
+	return buffer;
+}
+
+std::string EventWriter::GetMembers() const
+{
+	assert(buffer.length() >= 2 && buffer.front() == '{' && buffer.back() == '}');
+	return buffer.substr(1, buffer.length() - 2);
+}
+
+void EventWriter::AppendQuoted(std::string& outBuffer, const char* value)
+{
+	outBuffer += '"';
+	AppendEscaped(outBuffer, value, value + strlen(value));
+	outBuffer += '"';
+}
+
+void EventWriter::WriteKey(const char* key)
+{
+	// Keys that are not known by EventEncoder are read back from the database, so they are escaped like values
+	if (hasMembers)
+		buffer += ',';
+	AppendQuoted(buffer, key);
+	buffer += ':';
+	hasMembers = true;
+}
+
+void EventWriter::AppendEscaped(std::string& outBuffer, const char* value, const char* end)
+{
+	static const char hexDigits[] = "0123456789abcdef";
+
+	// Copy as many characters at once as possible, most strings don't need any escaping
+	const char* start = value;
+	for (const char* current = value; current != end; ++current)
+	{
+		const unsigned char character = (unsigned char)*current;
+		if (character >= 0x20 && character != '"' && character != '\\')
+			continue;
+
+		outBuffer.append(start, current);
+		start = current + 1;
+
+		switch (character)
+		{
+		case '"':
+			outBuffer += "\\\"";
+			break;
+		case '\\':
+			outBuffer += "\\\\";
+			break;
+		case '\b':
+			outBuffer += "\\b";
+			break;
+		case '\f':
+			outBuffer += "\\f";
+			break;
+		case '\n':
+			outBuffer += "\\n";
+			break;
+		case '\r':
+			outBuffer += "\\r";
+			break;
+		case '\t':
+			outBuffer += "\\t";
+			break;
+		default:
+			outBuffer += "\\u00";
+			outBuffer += hexDigits[character >> 4];
+			outBuffer += hexDigits[character & 0xF];
+			break;
+		}
+	}
+
+	outBuffer.append(start, end);
+}
\ No newline at end of file
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+
+namespace Analytics
+{
+	// Writes the json of an event straight into a buffer that is reused between events,
+	// so no Json::Value has to be built and no intermediate strings are created.
+	// Only writes flat objects, which is all the GameAnalytics events need.
+	class EventWriter
+	{
+	public:
+		EventWriter();
+
+		// Keeps the allocated memory of the buffer around for the next event
+		void Clear();
+
+		void BeginObject();
+		void EndObject();
+
+		void WriteString(const char* key, const char* value);
+		void WriteString(const char* key, const std::string& value);
+		void WriteString(const char* key, const char* value, size_t length);
+		void WriteInt(const char* key, long long value);
+		void WriteFloat(const char* key, float value);
+
+		// Value has to be quoted and escaped already
+		void WriteQuotedString(const char* key, const std::string& quotedValue);
+		void WriteQuotedString(const char* key, const char* quotedValue);
+		void WriteQuotedString(const char* key, const char* quotedValue, size_t length);
+
+		// Members have to be valid json members without the surrounding braces, like the output of GetMembers()
+		void WriteMembers(const std::string& members);
+
+		const std::string& GetBuffer() const;
+
+		// Only the members that were written, without the braces of the object
+		std::string GetMembers() const;
+
+		static void AppendQuoted(std::string& outBuffer, const char* value);
+
+	private:
+		void WriteKey(const char* key);
+		static void AppendEscaped(std::string& outBuffer, const char* value, const char* end);
+
+		std::string buffer;
+		bool hasMembers;
+	};
+}
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "GameAnalytics.h"
 #include "WebRequestHandler.h"
 #include "SystemHelpers.h"
+#include "EventWriter.h"
 
 #include <json/json.h>
 
@@ -20,22 +21,69 @@
 
 using namespace Analytics;
 
+std::atomic<unsigned int> GameAnalytics::nextInstanceId(1);
+
+namespace
+{
+	// Staging buffer of the calling thread for the instance that last used it, so it's only looked up once
+	struct ThreadStagingBuffer
+	{
+		unsigned int instanceId;
+		void* buffer;
+	};
+	thread_local ThreadStagingBuffer threadStagingBuffer = { 0, nullptr };
+}
+
 GameAnalytics::GameAnalytics(const std::string& secretKey, const std::string& gameId) :
 	isInitialized(false),
 	hasErrorHappened(false),
 	shouldStopThread(false),
+	threadQueue(1024), // Has to be a power of two
+	hasOverflowFunctions(false),
+	overflowPolicy(OverflowPolicy::Block),
+	isThreadWaiting(false),
+	updateFromThread(false),
+	threadUpdateInterval(0),
 	restInitialized(false),
 	sessionNumber(0),
 	serverTimestamp(0),
 	serverTimeDifference(0),
 	sessionStartTimestamp(0),
+	lastEventTimestamp(0),
+	isSessionCheckpointDirty(false),
+	sessionCheckpointInterval(0),
+	isCommitOpen(false),
+	numUncommittedEvents(0),
+	maxCommitBatchSize(0),
+	maxCommitLatency(0),
+	hasDirtyProgressionAttempts(false),
+	eventClientTimestamp(0),
+	eventCategory(EventCategory::Design),
 	analyticsSendTimer(0),
 	analyticsSendInterval(10.0f),
+	clockCalibrationInterval(60.0f),
+	maxPayloadTimeDrift(60),
+	maxBatchAttempts(20),
 	httpRequestCounter(0),
 	maxEventBatchSize(50),
+	durabilityProfile(DurabilityProfile::Balanced),
+	maxStoredEvents(0),
+	maxStoredEventBytes(0),
+	evictionPolicy(EvictionPolicy::OldestFirst),
+	reclaimFreePageThreshold(0),
+	reclaimTimeSlice(0),
+	isReclaimingFreePages(false),
+	eventStoreType(EventStoreType::Database),
+	eventLogSegmentSize(0),
+	maxEventsInMemory(0),
+	eventStore(&analyticsDatabase),
 	secretKey(secretKey),
-	gameId(gameId)
+	gameId(gameId),
+	instanceId(nextInstanceId++),
+	threadStagingBufferSize(0)
 {
+	for (int i = 0; i < EventCategory::Count; ++i)
+		numDroppedEvents[i] = 0;
 }
 
 GameAnalytics::~GameAnalytics()
@@ -46,7 +94,9 @@ GameAnalytics::~GameAnalytics()
 		if (hasErrorHappened)
 		{
 			// Delete database file
-			std::remove(dbFileName.c_str());
+			GameAnalyticsDatabase::DeleteDatabaseFiles(dbFileName.c_str());
+			if (eventStoreType == EventStoreType::SegmentedLog)
+				SegmentedEventLog::DeleteLogFiles(dbFileName.c_str());
 		}
 	}
 }
@@ -55,8 +105,43 @@ void GameAnalytics::Init(const InitData& initData)
 {
 	isInitialized = true;
 	dbFileName = initData.databaseFileName;
+	durabilityProfile = initData.durabilityProfile;
+	maxStoredEvents = initData.maxStoredEvents;
+	maxStoredEventBytes = initData.maxStoredEventBytes;
+	evictionPolicy = initData.evictionPolicy;
+	reclaimFreePageThreshold = initData.reclaimFreePageThreshold;
+	reclaimTimeSlice = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(initData.reclaimTimeSlice));
 	buildName = initData.buidName;
 	hashedUserId = initData.userId;
+	threadStagingBufferSize = initData.threadStagingBufferSize;
+	overflowPolicy = initData.overflowPolicy;
+	updateFromThread = initData.updateFromThread;
+	threadUpdateInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(initData.threadUpdateInterval));
+	sessionCheckpointInterval = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(initData.sessionCheckpointInterval));
+	maxCommitLatency = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<float>(initData.maxCommitLatency));
+	maxCommitBatchSize = std::max(initData.maxCommitBatchSize, 1u);
+	eventStoreType = initData.eventStore;
+	eventLogSegmentSize = initData.eventLogSegmentSize;
+	maxEventsInMemory = initData.maxEventsInMemory;
+	if (eventStoreType == EventStoreType::SegmentedLog && (maxStoredEvents > 0 || maxStoredEventBytes > 0))
+	{
+		// Whole segments can't be evicted without losing events that are being sent, so the log grows until they are sent
+		OutputDebugStringA("The segmented event log has no quota, maxStoredEvents and maxStoredEventBytes are ignored!\n");
+		assert(false);
+		maxStoredEvents = 0;
+		maxStoredEventBytes = 0;
+	}
+	if (maxEventsInMemory > 0)
+		eventStore = &hybridEventStore;
+	else if (eventStoreType == EventStoreType::SegmentedLog)
+		eventStore = &eventLog;
+	else
+		eventStore = &analyticsDatabase;
+
+	size_t queueCapacity = 2;
+	while (queueCapacity < initData.eventQueueCapacity)
+		queueCapacity *= 2;
+	eventQueue.reset(new LockFreeQueue<EventRecord>(queueCapacity));
 	osVersion = SystemHelpers::GetOSVersion();;
 	manufacturer = SystemHelpers::GetManufacturer();
 	if (manufacturer.length() > 32)
@@ -65,71 +150,104 @@ void GameAnalytics::Init(const InitData& initData)
 
 	requestHandler.Initialize();
 
+	// The thread initializes the database before it gets to any queued event or function
+	std::lock_guard<std::mutex> lock(threadMutex);
 	threadHandle = std::thread(&GameAnalytics::ThreadedFunction, this);
+}
 
-	QueueFunctionToThread([this] {
-		assert(!analyticsDatabase.IsInitialized()); // Already initialized!
-		if (analyticsDatabase.IsInitialized())
-			return;
+void GameAnalytics::InitializeFromThread()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
 
-		if (analyticsDatabase.Initialize(dbFileName.c_str()) != Result::Ok)
+	assert(!analyticsDatabase.IsInitialized()); // Already initialized!
+	if (analyticsDatabase.IsInitialized())
+		return;
+
+	if (analyticsDatabase.Initialize(dbFileName.c_str(), durabilityProfile) != Result::Ok)
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(dbFileName.c_str()); // Delete the db file and give it one more try
+		if (analyticsDatabase.Initialize(dbFileName.c_str(), durabilityProfile) != Result::Ok)
 		{
-			std::remove(dbFileName.c_str()); // Delete the db file and give it one more try
-			if (analyticsDatabase.Initialize(dbFileName.c_str()) != Result::Ok)
-			{
-				assert(false);
-				hasErrorHappened = true;
-				return;
-			}
+			assert(false);
+			hasErrorHappened = true;
+			return;
 		}
+	}
 
-		sessionNumber = analyticsDatabase.GetNumSessions();
-		sessionNumber++;
-		analyticsDatabase.SetNumSessions(sessionNumber);
+	// Session events are never evicted, like they are never dropped from the event queue
+	if (!analyticsDatabase.SetEventQuota(maxStoredEvents, maxStoredEventBytes, evictionPolicy, GetCategoryPriority(EventCategory::Progression)))
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
 
-		Json::Value eventData;
-		eventData["platform"] = "windows";
-		eventData["os_version"] = osVersion;
-		eventData["sdk_version"] = "rest api v2";
+	if (eventStoreType == EventStoreType::SegmentedLog && eventLog.Initialize(dbFileName.c_str(), eventLogSegmentSize) != Result::Ok)
+	{
+		assert(false);
+		hasErrorHappened = true;
+		return;
+	}
 
-		Json::Value arrayData;
-		arrayData.append(eventData);
+	if (maxEventsInMemory > 0)
+	{
+		// Events are stored in the database or log until there is a connection
+		if (eventStoreType == EventStoreType::SegmentedLog)
+			hybridEventStore.Initialize(&eventLog, maxEventsInMemory);
+		else
+			hybridEventStore.Initialize(&analyticsDatabase, maxEventsInMemory);
+	}
 
-		Json::FastWriter writer;
-		std::string stringData = writer.write(arrayData);
+	sessionNumber = analyticsDatabase.GetNumSessions();
+	sessionNumber++;
+	analyticsDatabase.SetNumSessions(sessionNumber);
+	defaultAnnotations.clear();
 
-		std::string hMacAuth;
-		if (!SystemHelpers::GenerateHmac(stringData, secretKey, hMacAuth))
-		{
-			hasErrorHappened = true;
-			return;
-		}
+	if (!LoadProgressionAttempts())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
 
-		if (!GameAnalytics::SendToGameAnalytics("init", stringData, hMacAuth, 0))
-		{
-			assert(false);
-			hasErrorHappened = true;
-			return;
-		}
+	Json::Value eventData;
+	eventData["platform"] = "windows";
+	eventData["os_version"] = osVersion;
+	eventData["sdk_version"] = "rest api v2";
 
-		// This will prepare any previously cached events to be sent after initialization has been confirmed
-		if (!analyticsDatabase.UnflagAllEvents())
-		{
-			assert(false);
-			hasErrorHappened = true;
-		}
-		if (!EndUnendedSessions())
-		{
-			assert(false);
-			hasErrorHappened = true;
-		}
-	});
+	Json::Value arrayData;
+	arrayData.append(eventData);
+
+	Json::FastWriter writer;
+	std::string stringData = writer.write(arrayData);
+
+	std::string hMacAuth;
+	if (!SystemHelpers::GenerateHmac(stringData, secretKey, hMacAuth))
+	{
+		hasErrorHappened = true;
+		return;
+	}
+
+	if (!GameAnalytics::SendToGameAnalytics("init", stringData, hMacAuth, 0))
+	{
+		assert(false);
+		hasErrorHappened = true;
+		return;
+	}
+
+	// Previously cached events are sent after initialization has been confirmed, the batches that were
+	// sent before the restart were already restored by the database
+	if (!EndUnendedSessions())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
 }
 
 void GameAnalytics::DeinitializeAndWaitForThread()
 {
 	if (isInitialized)
 	{
+		FlushAllStagingBuffers();
+
 		shouldStopThread = true;
 		QueueFunctionToThread([] {}); // Queue an empty function to continue thread
 		if (threadHandle.joinable())
@@ -150,6 +268,11 @@ void GameAnalytics::Update(float delta)
 	assert(isInitialized);
 	assert(std::this_thread::get_id() != threadHandle.get_id());
 
+	FlushAllStagingBuffers();
+
+	if (updateFromThread)
+		return; // The thread updates itself
+
 	if (requestHandler.IsInitialized())
 	{
 		QueueFunctionToThread([this, delta] {
@@ -165,13 +288,7 @@ void GameAnalytics::Update(float delta)
 			analyticsSendTimer = 0.0f;
 
 			QueueFunctionToThread([this] {
-				if (!SendCachedGameAnalyticsEvents())
-				{
-					OutputDebugStringA("SendCachedGameAnalyticsEvents() failed!\n");
-					assert(false);
-					hasErrorHappened = true;
-					restInitialized = false;
-				}
+				OnSendTimerElapsed();
 			});
 		}
 	}
@@ -180,294 +297,913 @@ void GameAnalytics::Update(float delta)
 void GameAnalytics::SendSessionStartEvent()
 {
 	assert(std::this_thread::get_id() != threadHandle.get_id());
-	QueueFunctionToThread([this] {
-		assert(sessionId.empty()); // Session is already active!
-		sessionId = SystemHelpers::GenerateNewSessionID();
 
-		Json::Value jsonValue;
-		GenerateDefaultAnnotations(jsonValue);
-		jsonValue["category"] = "user";
+	// Events staged by any thread before this have to be queued first, so they end up in the right session
+	FlushAllStagingBuffers();
 
-		sessionStartTimestamp = jsonValue.get("client_ts", 0).asInt64();
-
-		if (!AddGameAnalyticsEvent(jsonValue))
-		{
-			assert(false);
-			hasErrorHappened = true;
-		}
-	});
+	EventRecord record;
+	InitEventRecord(record, EventCategory::SessionStart);
+	PushEventToThread(record);
 }
 
 void GameAnalytics::SendSessionEndEvent()
 {
 	assert(std::this_thread::get_id() != threadHandle.get_id());
-	QueueFunctionToThread([this] {
-		assert(!sessionId.empty()); // No session active!
 
-		Json::Value jsonValue;
-		GenerateDefaultAnnotations(jsonValue);
-		jsonValue["category"] = "session_end";
-		jsonValue["length"] = jsonValue.get("client_ts", 0).asInt64() - sessionStartTimestamp;
+	// Events staged by any thread before this have to be queued first, so they end up in the right session
+	FlushAllStagingBuffers();
 
-		if (!AddGameAnalyticsEvent(jsonValue))
-		{
-			assert(false);
-			hasErrorHappened = true;
-		}
+	EventRecord record;
+	InitEventRecord(record, EventCategory::SessionEnd);
+	PushEventToThread(record);
+}
 
-		sessionId.clear();
-	});
+EventHandle GameAnalytics::RegisterEventId(const std::string& eventId)
+{
+	// Handles are used for both design and progression events, so the id is checked against the design rules here and
+	// against the progression rules when the handle is sent with a progression event
+	if (!EventSchema::IsValidDesignEventId(eventId.c_str()))
+	{
+		OutputDebugStringA("Event id doesn't follow the GameAnalytics rules, it is not registered!\n");
+		assert(false);
+		return EventHandle();
+	}
+
+	return eventIdRegistry.Register(eventId);
 }
 
 void GameAnalytics::SendDesignEvent(const std::string& eventId, float value)
 {
 	assert(std::this_thread::get_id() != threadHandle.get_id());
-	QueueFunctionToThread([this, eventId, value] {
-		Json::Value jsonValue;
-		GenerateDefaultAnnotations(jsonValue);
-		jsonValue["category"] = "design";
-		jsonValue["event_id"] = eventId;
-		jsonValue["value"] = value;
-		if (!AddGameAnalyticsEvent(jsonValue))
-		{
-			assert(false);
-			hasErrorHappened = true;
-		}
-	});
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Design);
+	if (!SetRecordEventId(record, eventId))
+		return;
+	record.hasValue = true;
+	record.value = value;
+	QueueEventToThread(record);
 }
 
 void GameAnalytics::SendDesignEvent(const std::string& eventId)
 {
 	assert(std::this_thread::get_id() != threadHandle.get_id());
-	QueueFunctionToThread([this, eventId] {
-		Json::Value jsonValue;
-		GenerateDefaultAnnotations(jsonValue);
-		jsonValue["category"] = "design";
-		jsonValue["event_id"] = eventId;
-		if (!AddGameAnalyticsEvent(jsonValue))
-		{
-			assert(false);
-			hasErrorHappened = true;
-		}
-	});
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Design);
+	if (SetRecordEventId(record, eventId))
+		QueueEventToThread(record);
+}
+
+void GameAnalytics::SendDesignEvent(EventHandle eventId, float value)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Design);
+	if (!SetRecordEventId(record, eventId))
+		return;
+	record.hasValue = true;
+	record.value = value;
+	QueueEventToThread(record);
+}
+
+void GameAnalytics::SendDesignEvent(EventHandle eventId)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Design);
+	if (SetRecordEventId(record, eventId))
+		QueueEventToThread(record);
+}
+
+void GameAnalytics::SendDesignEvent(const StaticDesignEventId& eventId, float value)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Design);
+	SetRecordEventId(record, eventId);
+	record.hasValue = true;
+	record.value = value;
+	QueueEventToThread(record);
+}
+
+void GameAnalytics::SendDesignEvent(const StaticDesignEventId& eventId)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Design);
+	SetRecordEventId(record, eventId);
+	QueueEventToThread(record);
 }
 
 void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, const std::string& eventId)
 {
 	assert(std::this_thread::get_id() != threadHandle.get_id());
 
-	QueueFunctionToThread([this, status, eventId] {
-		assert(!sessionId.empty()); // No session active!
-		assert(status != ProgressionStatus::Start || currentProgressionEventId.empty()); // Already in progress! #TODO: Fail progression and Start a new one
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Progression);
+	if (!SetRecordEventId(record, eventId))
+		return;
+	record.progressionStatus = status;
+	QueueEventToThread(record);
+}
 
-		currentProgressionEventId = eventId;
+void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, const std::string& eventId, const int score)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
 
-		Json::Value jsonValue;
-		GenerateDefaultAnnotations(jsonValue);
-		jsonValue["category"] = "progression";
-		jsonValue["event_id"] = ProgressionStatus::ToString(status) + ":" + eventId;
-		if (status == ProgressionStatus::Complete || status == ProgressionStatus::Fail)
-		{
-			int numAttempts = GetAndUpdateProgressionAttempts(status, eventId.c_str());
-			jsonValue["attempt_num"] = numAttempts;
-		}
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Progression);
+	if (!SetRecordEventId(record, eventId))
+		return;
+	record.progressionStatus = status;
+	record.hasScore = true;
+	record.score = score;
+	QueueEventToThread(record);
+}
 
-		if (!AddGameAnalyticsEvent(jsonValue))
+void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, EventHandle eventId)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Progression);
+	if (!SetRecordEventId(record, eventId))
+		return;
+	record.progressionStatus = status;
+	QueueEventToThread(record);
+}
+
+void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, EventHandle eventId, const int score)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Progression);
+	if (!SetRecordEventId(record, eventId))
+		return;
+	record.progressionStatus = status;
+	record.hasScore = true;
+	record.score = score;
+	QueueEventToThread(record);
+}
+
+void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, const StaticProgressionEventId& eventId)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Progression);
+	SetRecordEventId(record, status, eventId);
+	record.progressionStatus = status;
+	QueueEventToThread(record);
+}
+
+void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, const StaticProgressionEventId& eventId, const int score)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	EventRecord record;
+	InitEventRecord(record, EventCategory::Progression);
+	SetRecordEventId(record, status, eventId);
+	record.progressionStatus = status;
+	record.hasScore = true;
+	record.score = score;
+	QueueEventToThread(record);
+}
+
+void GameAnalytics::SendDesignEvents(const DesignEvent* events, size_t count)
+{
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!eventIdRegistry.IsValid(events[i].eventId))
 		{
+			OutputDebugStringA("Event handle is not registered, events are not sent!\n");
 			assert(false);
-			hasErrorHappened = true;
+			return;
 		}
+	}
+
+	if (threadStagingBufferSize > 0)
+		FlushStagingBuffer(*GetThreadStagingBuffer()); // Keep the order of the events sent by this thread
 
-		if (status != ProgressionStatus::Start)
-			currentProgressionEventId.clear();
+	QueueEventsToThread(count, [events](EventRecord& outRecord, size_t index) {
+		const DesignEvent& event = events[index];
+		InitEventRecord(outRecord, EventCategory::Design);
+		outRecord.eventHandle = event.eventId;
+		outRecord.hasValue = event.hasValue;
+		outRecord.value = event.value;
 	});
 }
 
-void GameAnalytics::SendProgressionEvent(ProgressionStatus::Enum status, const std::string& eventId, const int score)
+void GameAnalytics::SendProgressionEvents(const ProgressionEvent* events, size_t count)
 {
 	assert(std::this_thread::get_id() != threadHandle.get_id());
 
-	QueueFunctionToThread([this, status, eventId, score] {
-		assert(!sessionId.empty()); // No session active!
-		assert(status != ProgressionStatus::Start || currentProgressionEventId.empty()); // Already in progress! #TODO: Fail progression and Start a new one
-
-		currentProgressionEventId = eventId;
-
-		Json::Value jsonValue;
-		GenerateDefaultAnnotations(jsonValue);
-		jsonValue["category"] = "progression";
-		jsonValue["event_id"] = ProgressionStatus::ToString(status) + ":" + eventId;
-		jsonValue["score"] = score;
-		if (status == ProgressionStatus::Complete || status == ProgressionStatus::Fail)
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (!eventIdRegistry.IsValid(events[i].eventId))
 		{
-			int numAttempts = GetAndUpdateProgressionAttempts(status, eventId.c_str());
-			jsonValue["attempt_num"] = numAttempts;
+			OutputDebugStringA("Event handle is not registered, events are not sent!\n");
+			assert(false);
+			return;
 		}
-
-		if (!AddGameAnalyticsEvent(jsonValue))
+		if (!eventIdRegistry.IsProgressionEventId(events[i].eventId))
 		{
+			OutputDebugStringA("Event id has too many parts for a progression event, events are not sent!\n");
 			assert(false);
-			hasErrorHappened = true;
+			return;
 		}
+	}
 
-		if (status != ProgressionStatus::Start)
-			currentProgressionEventId.clear();
+	if (threadStagingBufferSize > 0)
+		FlushStagingBuffer(*GetThreadStagingBuffer()); // Keep the order of the events sent by this thread
+
+	QueueEventsToThread(count, [events](EventRecord& outRecord, size_t index) {
+		const ProgressionEvent& event = events[index];
+		InitEventRecord(outRecord, EventCategory::Progression);
+		outRecord.eventHandle = event.eventId;
+		outRecord.progressionStatus = event.status;
+		outRecord.hasScore = event.hasScore;
+		outRecord.score = event.score;
 	});
 }
 
+void GameAnalytics::FlushThreadEvents()
+{
+	if (threadStagingBufferSize == 0)
+		return;
+
+	// The thread is about to exit, so give up its buffer instead of keeping it around for a thread that reuses its id
+	std::lock_guard<std::mutex> lock(stagingBuffersMutex);
+	auto itr = stagingBuffers.find(std::this_thread::get_id());
+	if (itr == stagingBuffers.end())
+		return;
+
+	FlushStagingBuffer(*itr->second);
+	stagingBuffers.erase(itr);
+
+	if (threadStagingBuffer.instanceId == instanceId)
+		threadStagingBuffer = { 0, nullptr };
+}
+
 void GameAnalytics::ThreadedFunction()
 {
+	{
+		std::lock_guard<std::mutex> lock(threadMutex); // Held by Init() until threadHandle is set
+	}
+	InitializeFromThread();
+
+	EventRecord record;
+	std::chrono::steady_clock::time_point lastUpdateTime = std::chrono::steady_clock::now();
 	while (true)
 	{
-		std::queue<std::function<void()>> queueCopy;
+		// Functions run once per pass, none of them has to run before the events that were queued after it.
+		// At most a full queue of events at a time, so sending and checkpoints still happen while events keep coming in.
+		RunQueuedFunctions();
+		const size_t maxEventsPerPass = eventQueue->GetCapacity();
+		for (size_t i = 0; i < maxEventsPerPass && eventQueue->TryPop(record); ++i)
+			ProcessEvent(record);
+
+		if (updateFromThread)
+		{
+			const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+			if (now - lastUpdateTime >= threadUpdateInterval)
+			{
+				ProcessStagedEvents();
+				UpdateFromThread(std::chrono::duration<float>(now - lastUpdateTime).count());
+				lastUpdateTime = now;
+			}
+		}
+
+		if (isSessionCheckpointDirty && std::chrono::steady_clock::now() - lastSessionCheckpointTime >= sessionCheckpointInterval)
+		{
+			if (!CheckpointSession())
+			{
+				assert(false);
+				hasErrorHappened = true;
+			}
+		}
+
+		// Don't keep the transaction open while waiting or sending
+		CommitEvents();
+
+		// Only while idle, a slice at a time so the queues are checked in between
+		const bool hasFreePagesLeft = eventQueue->IsEmpty() && ReclaimFreePages();
+
+		std::unique_lock<std::mutex> lock(threadMutex);
+		isThreadWaiting = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the fence in WakeThread()
+		if (!threadQueue.IsEmpty() || hasOverflowFunctions || !eventQueue->IsEmpty())
+		{
+			isThreadWaiting = false;
+			continue;
+		}
+		if (shouldStopThread)
 		{
-			std::unique_lock<std::mutex> lock(threadMutex);
-			while (threadQueue.empty())
+			lock.unlock();
+			if (!StoreProgressionAttempts() || !CheckpointSession() || !hybridEventStore.Spill())
 			{
-				if (shouldStopThread)
-					return; // Return here to make sure the queue is completely empty before stopping thread
-				threadCondition.wait(lock);
+				assert(false);
+				hasErrorHappened = true;
 			}
-			std::swap(queueCopy, threadQueue);
+			return; // Return here to make sure the queue is completely empty before stopping thread
 		}
-		while (!queueCopy.empty())
+		if (hasFreePagesLeft)
 		{
-			queueCopy.front()();
-			queueCopy.pop();
+			isThreadWaiting = false;
+			continue;
 		}
+		if (updateFromThread)
+			threadCondition.wait_until(lock, lastUpdateTime + threadUpdateInterval);
+		else
+			threadCondition.wait(lock);
+		isThreadWaiting = false;
 	}
 }
 
-void GameAnalytics::GenerateDefaultAnnotations(Json::Value& outAnnotations)
+void GameAnalytics::UpdateFromThread(float delta)
 {
 	assert(std::this_thread::get_id() == threadHandle.get_id());
 
-	//assert(!sessionId.empty()); // No session has started yet!
-
-	// Required
-	outAnnotations["device"] = device;
-	outAnnotations["v"] = 2;
-	outAnnotations["user_id"] = hashedUserId;
-	outAnnotations["client_ts"] = Timing::GetNowTime();
-	outAnnotations["sdk_version"] = "rest api v2";
-	outAnnotations["os_version"] = osVersion;
-	assert(manufacturer.length() <= 32);
-	outAnnotations["manufacturer"] = manufacturer;
-	outAnnotations["platform"] = "windows";
-	outAnnotations["session_id"] = sessionId;
-	outAnnotations["session_num"] = sessionNumber;
-
-	// Optional
-	outAnnotations["build"] = buildName;
+	if (requestHandler.IsInitialized())
+		requestHandler.Update(delta);
 
-	if (!currentProgressionEventId.empty())
+	if (restInitialized)
 	{
-		// This is not according to documentation, but can be found in another implementation..
-		outAnnotations["progression"] = currentProgressionEventId;
+		analyticsSendTimer += delta;
+		if (analyticsSendTimer >= analyticsSendInterval)
+		{
+			analyticsSendTimer = 0.0f;
+			OnSendTimerElapsed();
+		}
 	}
 }
 
-bool GameAnalytics::AddGameAnalyticsEvent(const Json::Value& eventData)
+void GameAnalytics::OnSendTimerElapsed()
 {
 	assert(std::this_thread::get_id() == threadHandle.get_id());
 
-	Json::FastWriter writer;
-	std::string jsonString = writer.write(eventData);
+	Timing::CalibrateIfOlderThan(clockCalibrationInterval);
 
-	if (!analyticsDatabase.UpdateSessionEnds(eventData, jsonString.c_str(), sessionStartTimestamp))
+	if (!StoreProgressionAttempts())
 	{
 		assert(false);
-		return false;
+		hasErrorHappened = true;
 	}
 
-	if (!analyticsDatabase.AddEvent(jsonString.c_str()))
+	if (!SendCachedGameAnalyticsEvents())
 	{
+		OutputDebugStringA("SendCachedGameAnalyticsEvents() failed!\n");
 		assert(false);
-		return false;
+		hasErrorHappened = true;
+		restInitialized = false;
 	}
+}
 
-	return true;
+void GameAnalytics::RunQueuedFunctions()
+{
+	std::function<void()> func;
+	while (true)
+	{
+		while (threadQueue.TryPop(func))
+		{
+			func();
+			func = nullptr;
+		}
+
+		if (!hasOverflowFunctions)
+			return;
+
+		// Overflowed functions were queued after the ones in the queue, so only take them when the queue is empty
+		std::deque< std::function<void()> > functions;
+		{
+			std::lock_guard<std::mutex> lock(overflowFunctionsMutex);
+			if (!threadQueue.IsEmpty())
+				continue;
+
+			functions.swap(overflowFunctions);
+			hasOverflowFunctions = false;
+		}
+
+		for (auto itr = functions.begin(); itr != functions.end(); ++itr)
+			(*itr)();
+	}
 }
 
-bool GameAnalytics::SendCachedGameAnalyticsEvents()
+void GameAnalytics::ProcessEvent(const EventRecord& record)
 {
 	assert(std::this_thread::get_id() == threadHandle.get_id());
-	assert(restInitialized);
 
-	// Flag the events as sent
-	++httpRequestCounter;
-	if (!analyticsDatabase.FlagEvents(httpRequestCounter, maxEventBatchSize))
+	if (!isCommitOpen && analyticsDatabase.IsInitialized())
 	{
-		OutputDebugStringA("FlagDatabaseEvents() failed!\n");
-		return false;
+		// Store all events that are queued right now in one transaction, instead of committing every single one
+		isCommitOpen = eventStore->BeginTransaction();
+		commitOpenTime = std::chrono::steady_clock::now();
 	}
 
-	Json::Value jsonValue;
-	if (!analyticsDatabase.RetrieveFlaggedEvents(httpRequestCounter, jsonValue, serverTimeDifference))
+	switch (record.category)
 	{
-		OutputDebugStringA("RetrieveFlaggedDatabaseEvents() failed!\n");
-		return false;
-	}
+	case EventCategory::SessionStart:
+		ProcessSessionStartEvent(record);
+		break;
 
-	if (jsonValue.empty())
-		return true; // Nothing to send, no error
+	case EventCategory::SessionEnd:
+		ProcessSessionEndEvent(record);
+		break;
 
-	Json::FastWriter writer;
-	std::string stringData = writer.write(jsonValue);
+	case EventCategory::Design:
+		ProcessDesignEvent(record);
+		break;
 
-	std::string hMacAuth;
-	if (!SystemHelpers::GenerateHmac(stringData, secretKey, hMacAuth))
-		return false;
+	case EventCategory::Progression:
+		ProcessProgressionEvent(record);
+		break;
 
-	int requestNum = httpRequestCounter;
-	//QueueFunctionToMainThread([this, stringData, hMacAuth, requestNum] {
-		if (!GameAnalytics::SendToGameAnalytics("events", stringData, hMacAuth, requestNum))
-		{
-			OutputDebugStringA("SendToGameAnalytics() failed!\n");
-			hasErrorHappened = true;
-		}
-	//});
+	default:
+		assert(false);
+		break;
+	}
 
-	return true;
+	if (isCommitOpen && (++numUncommittedEvents >= maxCommitBatchSize || std::chrono::steady_clock::now() - commitOpenTime >= maxCommitLatency))
+		CommitEvents();
 }
 
-int GameAnalytics::GetAndUpdateProgressionAttempts(ProgressionStatus::Enum status, const char* progressionEventId)
+void GameAnalytics::ProcessStagedEvents()
 {
-	assert(std::this_thread::get_id() == threadHandle.get_id());
+	if (threadStagingBufferSize == 0)
+		return;
+
+	// Events of the buffers that were queued before have to be processed first
+	if (!eventQueue->IsEmpty())
+		return;
 
-	int numAttempts = 0;
-	switch (status)
 	{
-	case ProgressionStatus::Start:
-		break;
+		// A game thread can hold the locks while it waits for room in the queue, so don't wait for them
+		std::unique_lock<std::mutex> lock(stagingBuffersMutex, std::try_to_lock);
+		if (!lock.owns_lock())
+			return;
 
-	case ProgressionStatus::Fail:
-		if (!analyticsDatabase.GetProgressionAttempts(progressionEventId, numAttempts))
+		// Only take the records out, the game threads can stage new ones while they are processed
+		for (auto itr = stagingBuffers.begin(); itr != stagingBuffers.end(); ++itr)
 		{
-			assert(false);
-			hasErrorHappened = true;
+			StagingBuffer& buffer = *itr->second;
+			std::unique_lock<std::mutex> bufferLock(buffer.mutex, std::try_to_lock);
+			if (!bufferLock.owns_lock() || buffer.numRecords == 0)
+				continue;
+
+			stagedRecords.insert(stagedRecords.end(), buffer.records.begin(), buffer.records.begin() + buffer.numRecords);
+			buffer.numRecords = 0;
 		}
-		numAttempts++;
-		if (!analyticsDatabase.SetProgressionAttempts(progressionEventId, numAttempts))
+	}
+
+	for (size_t i = 0; i < stagedRecords.size(); ++i)
+		ProcessEvent(stagedRecords[i]);
+	stagedRecords.clear();
+}
+
+void GameAnalytics::CommitEvents()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	if (!isCommitOpen)
+		return;
+
+	isCommitOpen = false;
+	numUncommittedEvents = 0;
+	if (!eventStore->CommitTransaction())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+}
+
+bool GameAnalytics::ReclaimFreePages()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+	assert(!isCommitOpen);
+
+	if (!analyticsDatabase.IsInitialized() || !analyticsDatabase.CanReclaimFreePages())
+		return false;
+
+	// Once started, all free pages are reclaimed, so this doesn't start again for every few pages that are freed
+	int numFreePages = 0;
+	if (!analyticsDatabase.GetNumFreePages(numFreePages) || numFreePages == 0 || (!isReclaimingFreePages && (unsigned int)numFreePages <= reclaimFreePageThreshold))
+	{
+		isReclaimingFreePages = false;
+		return false;
+	}
+
+	isReclaimingFreePages = true;
+	const std::chrono::steady_clock::time_point endTime = std::chrono::steady_clock::now() + reclaimTimeSlice;
+	do
+	{
+		const int numPreviousFreePages = numFreePages;
+		if (!analyticsDatabase.ReclaimFreePages(numFreePages))
 		{
+			// The file only stays larger than needed
 			assert(false);
-			hasErrorHappened = true;
+			isReclaimingFreePages = false;
+			return false;
 		}
-		break;
 
-	case ProgressionStatus::Complete:
-		if (!analyticsDatabase.GetProgressionAttempts(progressionEventId, numAttempts))
+		// Try again on the next round instead of spinning on pages that can't be reclaimed right now
+		if (numFreePages >= numPreviousFreePages)
 		{
-			assert(false);
+			isReclaimingFreePages = false;
+			return false;
+		}
+	} while (numFreePages > 0 && std::chrono::steady_clock::now() < endTime);
+
+	isReclaimingFreePages = (numFreePages > 0);
+	return isReclaimingFreePages;
+}
+
+void GameAnalytics::ProcessSessionStartEvent(const EventRecord& record)
+{
+	assert(sessionId.empty()); // Session is already active!
+	sessionId = SystemHelpers::GenerateNewSessionID();
+	defaultAnnotations.clear();
+
+	sessionStartTimestamp = record.clientTimestamp;
+
+	BeginGameAnalyticsEvent(EventCategory::SessionStart, sessionStartTimestamp);
+	if (!EndGameAnalyticsEvent())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+
+	// Store the session right away, so it can be ended when the game crashes before the first checkpoint
+	if (!CheckpointSession())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+}
+
+void GameAnalytics::ProcessSessionEndEvent(const EventRecord& record)
+{
+	assert(!sessionId.empty()); // No session active!
+
+	EventEncoder& encoder = BeginGameAnalyticsEvent(EventCategory::SessionEnd, record.clientTimestamp);
+	encoder.WriteInt("length", record.clientTimestamp - sessionStartTimestamp);
+	if (!EndGameAnalyticsEvent() || !analyticsDatabase.DeleteSessionEnd(sessionId.c_str()))
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+	isSessionCheckpointDirty = false;
+
+	sessionId.clear();
+	defaultAnnotations.clear();
+
+	// Sessions often end right before the game is closed
+	if (!StoreProgressionAttempts())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+}
+
+void GameAnalytics::ProcessDesignEvent(const EventRecord& record)
+{
+	EventEncoder& encoder = BeginGameAnalyticsEvent(EventCategory::Design, record.clientTimestamp);
+	if (record.staticQuotedEventId != nullptr)
+		encoder.WriteQuotedString("event_id", record.staticQuotedEventId);
+	else if (record.eventHandle.id != EventHandle::InvalidId)
+		encoder.WriteQuotedString("event_id", eventIdRegistry.GetQuotedEventId(record.eventHandle));
+	else
+		encoder.WriteString("event_id", record.eventId);
+	if (record.hasValue)
+		encoder.WriteFloat("value", record.value);
+
+	if (!EndGameAnalyticsEvent())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+}
+
+void GameAnalytics::ProcessProgressionEvent(const EventRecord& record)
+{
+	const ProgressionStatus::Enum status = record.progressionStatus;
+	const char* eventId = GetRecordEventId(record);
+
+	assert(!sessionId.empty()); // No session active!
+	assert(status != ProgressionStatus::Start || currentProgressionEventId.empty()); // Already in progress! #TODO: Fail progression and Start a new one
+
+	SetCurrentProgression(eventId);
+
+	int numAttempts = 0;
+	if (status == ProgressionStatus::Complete || status == ProgressionStatus::Fail)
+		numAttempts = GetAndUpdateProgressionAttempts(status, eventId);
+
+	EventEncoder& encoder = BeginGameAnalyticsEvent(EventCategory::Progression, record.clientTimestamp);
+	if (record.staticQuotedEventId != nullptr)
+	{
+		encoder.WriteQuotedString("event_id", record.staticQuotedEventId);
+	}
+	else
+	{
+		encoder.BeginString("event_id");
+		encoder.AppendToString(ProgressionStatus::ToString(status).c_str());
+		encoder.AppendToString(":");
+		encoder.AppendToString(eventId);
+		encoder.EndString();
+	}
+	if (record.hasScore)
+		encoder.WriteInt("score", record.score);
+	if (numAttempts > 0)
+		encoder.WriteInt("attempt_num", numAttempts);
+
+	if (!EndGameAnalyticsEvent())
+	{
+		assert(false);
+		hasErrorHappened = true;
+	}
+
+	if (status != ProgressionStatus::Start)
+		SetCurrentProgression("");
+}
+
+const char* GameAnalytics::GetRecordEventId(const EventRecord& record) const
+{
+	if (record.staticEventId != nullptr)
+		return record.staticEventId;
+	if (record.eventHandle.id != EventHandle::InvalidId)
+		return eventIdRegistry.GetEventId(record.eventHandle).c_str();
+	return record.eventId;
+}
+
+const std::string& GameAnalytics::GetDefaultAnnotations()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	if (!defaultAnnotations.empty())
+		return defaultAnnotations;
+
+	//assert(!sessionId.empty()); // No session has started yet!
+
+	EventWriter writer;
+	writer.BeginObject();
+
+	// Required
+	writer.WriteString("device", device);
+	writer.WriteInt("v", 2);
+	writer.WriteString("user_id", hashedUserId);
+	writer.WriteString("sdk_version", "rest api v2");
+	writer.WriteString("os_version", osVersion);
+	assert(manufacturer.length() <= 32);
+	writer.WriteString("manufacturer", manufacturer);
+	writer.WriteString("platform", "windows");
+	writer.WriteString("session_id", sessionId);
+	writer.WriteInt("session_num", sessionNumber);
+
+	// Optional
+	writer.WriteString("build", buildName);
+
+	if (!currentProgressionEventId.empty())
+	{
+		// This is not according to documentation, but can be found in another implementation..
+		writer.WriteString("progression", currentProgressionEventId);
+	}
+
+	writer.EndObject();
+
+	// Only keep the members, so the fields of each event can be appended to them
+	defaultAnnotations = writer.GetMembers();
+	return defaultAnnotations;
+}
+
+void GameAnalytics::SetCurrentProgression(const char* progressionEventId)
+{
+	if (currentProgressionEventId == progressionEventId)
+		return;
+
+	currentProgressionEventId = progressionEventId;
+	defaultAnnotations.clear();
+}
+
+EventEncoder& GameAnalytics::BeginGameAnalyticsEvent(EventCategory::Enum category, long long clientTimestamp)
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	// The default annotations and client_ts are stored separately, so they don't have to be encoded
+	eventEncoder.Clear();
+	eventEncoder.WriteString("category", GetCategoryName(category));
+	eventClientTimestamp = clientTimestamp;
+	eventCategory = category;
+
+	// Only kept in memory, the session is stored by CheckpointSession()
+	lastEventTimestamp = clientTimestamp;
+	isSessionCheckpointDirty = true;
+
+	return eventEncoder;
+}
+
+bool GameAnalytics::EndGameAnalyticsEvent()
+{
+	return StoreGameAnalyticsEvent(GetDefaultAnnotations(), eventClientTimestamp, eventEncoder.GetBuffer(), eventCategory);
+}
+
+bool GameAnalytics::StoreGameAnalyticsEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, EventCategory::Enum category)
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	if (!eventStore->AddEvent(defaultAnnotations, clientTimestamp, encodedEvent, GetCategoryPriority(category)))
+	{
+		assert(false);
+		return false;
+	}
+
+	return true;
+}
+
+bool GameAnalytics::CheckpointSession()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	if (!isSessionCheckpointDirty || sessionId.empty() || !analyticsDatabase.IsInitialized())
+		return true;
+
+	lastSessionCheckpointTime = std::chrono::steady_clock::now();
+	isSessionCheckpointDirty = false;
+
+	return analyticsDatabase.SetSessionEnd(sessionId.c_str(), sessionStartTimestamp, lastEventTimestamp, GetDefaultAnnotations().c_str());
+}
+
+const char* GameAnalytics::GetCategoryName(EventCategory::Enum category)
+{
+	switch (category)
+	{
+	case EventCategory::SessionStart:
+		return "user";
+	case EventCategory::SessionEnd:
+		return "session_end";
+	case EventCategory::Design:
+		return "design";
+	case EventCategory::Progression:
+		return "progression";
+	default:
+		assert(false);
+		return "";
+	}
+}
+
+bool GameAnalytics::SendCachedGameAnalyticsEvents()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+	assert(restInitialized);
+
+	// Lease the oldest events that are not being sent yet
+	++httpRequestCounter;
+	if (!eventStore->LeaseEvents(httpRequestCounter, maxEventBatchSize))
+	{
+		OutputDebugStringA("LeaseEvents() failed!\n");
+		return false;
+	}
+
+	// A batch that was sent before is sent again as it was, unless the server time changed too much since then
+	bool hasPayload = false;
+	std::string stringData;
+	std::string hMacAuth;
+	long long payloadServerTimeDifference = 0;
+	if (!eventStore->GetLeasedPayload(httpRequestCounter, hasPayload, stringData, hMacAuth, payloadServerTimeDifference))
+	{
+		OutputDebugStringA("GetLeasedPayload() failed!\n");
+		return false;
+	}
+
+	const long long payloadTimeDrift = payloadServerTimeDifference - serverTimeDifference;
+	if (!hasPayload || payloadTimeDrift < -maxPayloadTimeDrift || payloadTimeDrift > maxPayloadTimeDrift)
+	{
+		stringData.clear();
+		if (!eventStore->RetrieveLeasedEvents(httpRequestCounter, stringData, serverTimeDifference))
+		{
+			OutputDebugStringA("RetrieveLeasedEvents() failed!\n");
+			return false;
+		}
+
+		if (stringData.empty())
+			return true; // Nothing to send, no error
+
+		if (!SystemHelpers::GenerateHmac(stringData, secretKey, hMacAuth))
+			return false;
+
+		if (!eventStore->SetLeasedPayload(httpRequestCounter, stringData, hMacAuth, serverTimeDifference))
+		{
+			OutputDebugStringA("SetLeasedPayload() failed!\n");
+			return false;
+		}
+	}
+
+	int requestNum = httpRequestCounter;
+	//QueueFunctionToMainThread([this, stringData, hMacAuth, requestNum] {
+		if (!GameAnalytics::SendToGameAnalytics("events", stringData, hMacAuth, requestNum))
+		{
+			OutputDebugStringA("SendToGameAnalytics() failed!\n");
 			hasErrorHappened = true;
 		}
-		analyticsDatabase.DeleteProgressionAttempts(progressionEventId);
-		numAttempts++;
-		break;
+	//});
+
+	return true;
+}
+
+bool GameAnalytics::ReleaseRejectedEvents(int requestId)
+{
+	// Only counts answers of the server, batches that couldn't be sent at all are kept
+	int numAttempts = 0;
+	if (!eventStore->AddLeasedAttempt(requestId, numAttempts))
+	{
+		OutputDebugStringA("AddLeasedAttempt() failed!\n");
+		return false;
+	}
+
+	// Sending it again won't help anymore, the other batches can still be sent
+	if (numAttempts > maxBatchAttempts)
+	{
+		OutputDebugStringA("Batch was rejected too often, its events are dropped!\n");
+		return eventStore->DeleteLeasedEvents(requestId);
 	}
+
+	// The payload is built again when the batch is sent again
+	return eventStore->ClearLeasedPayload(requestId) && eventStore->ReleaseEvents(requestId);
+}
+
+int GameAnalytics::GetAndUpdateProgressionAttempts(ProgressionStatus::Enum status, const char* progressionEventId)
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	if (status == ProgressionStatus::Start)
+		return 0;
+
+	ProgressionAttempts& attempts = progressionAttempts[progressionEventId];
+	const int numAttempts = attempts.numAttempts + 1;
+
+	// A completed progression starts counting from the beginning again
+	attempts.numAttempts = (status == ProgressionStatus::Complete) ? 0 : numAttempts;
+	attempts.isDirty = true;
+	hasDirtyProgressionAttempts = true;
+
 	return numAttempts;
 }
 
+bool GameAnalytics::LoadProgressionAttempts()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	std::unordered_map<std::string, int> storedAttempts;
+	if (!analyticsDatabase.GetAllProgressionAttempts(storedAttempts))
+		return false;
+
+	progressionAttempts.clear();
+	for (auto itr = storedAttempts.begin(); itr != storedAttempts.end(); ++itr)
+		progressionAttempts[itr->first].numAttempts = itr->second;
+
+	hasDirtyProgressionAttempts = false;
+	return true;
+}
+
+bool GameAnalytics::StoreProgressionAttempts()
+{
+	assert(std::this_thread::get_id() == threadHandle.get_id());
+
+	if (!hasDirtyProgressionAttempts || !analyticsDatabase.IsInitialized())
+		return true;
+
+	if (!analyticsDatabase.BeginTransaction())
+		return false;
+
+	bool succeeded = true;
+	for (auto itr = progressionAttempts.begin(); itr != progressionAttempts.end();)
+	{
+		ProgressionAttempts& attempts = itr->second;
+		if (attempts.isDirty)
+		{
+			if (attempts.numAttempts > 0)
+				succeeded &= analyticsDatabase.SetProgressionAttempts(itr->first.c_str(), attempts.numAttempts);
+			else
+				succeeded &= analyticsDatabase.DeleteProgressionAttempts(itr->first.c_str());
+			attempts.isDirty = false;
+		}
+
+		if (attempts.numAttempts == 0)
+			itr = progressionAttempts.erase(itr);
+		else
+			++itr;
+	}
+
+	hasDirtyProgressionAttempts = false;
+	return analyticsDatabase.CommitTransaction() && succeeded;
+}
+
 bool GameAnalytics::EndUnendedSessions()
 {
 	assert(std::this_thread::get_id() == threadHandle.get_id());
@@ -478,16 +1214,15 @@ bool GameAnalytics::EndUnendedSessions()
 
 	for (auto itr = toEndSessions.begin(); itr != toEndSessions.end(); ++itr)
 	{
-		Json::Reader reader;
-		Json::Value root;
-		if (reader.parse(itr->annotations, root, false))
-		{
-			root["category"] = "session_end";
-			root["length"] = root.get("client_ts", 0).asInt64() - itr->sessionStartTimestamp;
-
-			if (!AddGameAnalyticsEvent(root))
-				return false;
-		}
+		// End the session at the last checkpoint, with the annotations it had at that time
+		eventEncoder.Clear();
+		eventEncoder.WriteString("category", GetCategoryName(EventCategory::SessionEnd));
+		eventEncoder.WriteInt("length", itr->lastEventTimestamp - itr->sessionStartTimestamp);
+
+		if (!StoreGameAnalyticsEvent(itr->defaultAnnotations, itr->lastEventTimestamp, eventEncoder.GetBuffer(), EventCategory::SessionEnd))
+			return false;
+		if (!analyticsDatabase.DeleteSessionEnd(itr->sessionId.c_str()))
+			return false;
 	}
 
 	return true;
@@ -512,11 +1247,295 @@ void GameAnalytics::QueueFunctionToThread(std::function<void()> func)
 {
 	assert(isInitialized);
 	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	// Functions are rare compared to events, so when the queue is full they are kept in a list instead of blocking the caller
+	if (hasOverflowFunctions || !threadQueue.TryPush(std::move(func)))
+	{
+		std::lock_guard<std::mutex> lock(overflowFunctionsMutex);
+		overflowFunctions.push_back(std::move(func));
+		hasOverflowFunctions = true;
+	}
+	WakeThread();
+}
+
+void GameAnalytics::InitEventRecord(EventRecord& outRecord, EventCategory::Enum category)
+{
+	outRecord.category = category;
+	outRecord.progressionStatus = ProgressionStatus::Start;
+	outRecord.hasValue = false;
+	outRecord.hasScore = false;
+	outRecord.value = 0.0f;
+	outRecord.score = 0;
+	outRecord.eventHandle = EventHandle();
+	outRecord.staticEventId = nullptr;
+	outRecord.staticQuotedEventId = nullptr;
+	outRecord.clientTimestamp = Timing::GetNowTime();
+	outRecord.eventId[0] = '\0';
+}
+
+bool GameAnalytics::SetRecordEventId(EventRecord& outRecord, const std::string& eventId)
+{
+	if (eventId.length() > EventRecord::MaxEventIdLength)
+	{
+		OutputDebugStringA("Event id is too long, event is not sent!\n");
+		assert(false);
+		return false;
+	}
+
+	// Don't store and upload events that the collector rejects anyway
+	const bool isValid = (outRecord.category == EventCategory::Progression) ? EventSchema::IsValidProgressionEventId(eventId.c_str()) : EventSchema::IsValidDesignEventId(eventId.c_str());
+	if (!isValid)
+	{
+		OutputDebugStringA("Event id doesn't follow the GameAnalytics rules, event is not sent!\n");
+		assert(false);
+		return false;
+	}
+
+	memcpy(outRecord.eventId, eventId.c_str(), eventId.length() + 1);
+	return true;
+}
+
+bool GameAnalytics::SetRecordEventId(EventRecord& outRecord, EventHandle eventId) const
+{
+	if (!eventIdRegistry.IsValid(eventId))
+	{
+		OutputDebugStringA("Event handle is not registered, event is not sent!\n");
+		assert(false);
+		return false;
+	}
+
+	if (outRecord.category == EventCategory::Progression && !eventIdRegistry.IsProgressionEventId(eventId))
+	{
+		OutputDebugStringA("Event id has too many parts for a progression event, event is not sent!\n");
+		assert(false);
+		return false;
+	}
+
+	outRecord.eventHandle = eventId;
+	return true;
+}
+
+void GameAnalytics::SetRecordEventId(EventRecord& outRecord, const StaticDesignEventId& eventId)
+{
+	outRecord.staticEventId = eventId.eventId;
+	outRecord.staticQuotedEventId = eventId.quotedEventId;
+}
+
+void GameAnalytics::SetRecordEventId(EventRecord& outRecord, ProgressionStatus::Enum status, const StaticProgressionEventId& eventId)
+{
+	outRecord.staticEventId = eventId.eventId;
+	switch (status)
+	{
+	case ProgressionStatus::Start:
+		outRecord.staticQuotedEventId = eventId.quotedStartEventId;
+		break;
+	case ProgressionStatus::Fail:
+		outRecord.staticQuotedEventId = eventId.quotedFailEventId;
+		break;
+	case ProgressionStatus::Complete:
+		outRecord.staticQuotedEventId = eventId.quotedCompleteEventId;
+		break;
+	}
+}
+
+void GameAnalytics::QueueEventToThread(const EventRecord& record)
+{
+	if (threadStagingBufferSize > 0)
+		StageEvent(record);
+	else
+		PushEventToThread(record);
+}
+
+void GameAnalytics::PushEventToThread(const EventRecord& record)
+{
+	assert(isInitialized);
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	while (!eventQueue->TryPush(record))
+	{
+		if (!HandleQueueOverflow(record.category))
+			return; // Event is dropped
+	}
+	WakeThread();
+}
+
+bool GameAnalytics::HandleQueueOverflow(EventCategory::Enum category)
+{
+	const bool isSessionEvent = (category == EventCategory::SessionStart || category == EventCategory::SessionEnd);
+	const OverflowPolicy::Enum policy = overflowPolicy;
+
+	if (policy == OverflowPolicy::DropOldest || policy == OverflowPolicy::DropByCategory)
+	{
+		const int priority = GetCategoryPriority(category);
+		auto canEvict = [policy, priority, isSessionEvent](const EventRecord& oldest) {
+			const int oldestPriority = GetCategoryPriority(oldest.category);
+			if (oldestPriority == GetCategoryPriority(EventCategory::SessionStart))
+				return false; // Session events are never dropped
+			return (policy == OverflowPolicy::DropOldest || isSessionEvent || oldestPriority < priority);
+		};
+
+		EventRecord evicted;
+		if (eventQueue->TryPopIf(canEvict, evicted))
+		{
+			++numDroppedEvents[evicted.category];
+			return true; // Made room, try again
+		}
+	}
+
+	if (policy != OverflowPolicy::Block && !isSessionEvent)
+	{
+		++numDroppedEvents[category];
+		return false;
+	}
+
+	// Make sure the thread is draining the queue and try again
+	WakeThread();
+	std::this_thread::yield();
+	return true;
+}
+
+int GameAnalytics::GetCategoryPriority(EventCategory::Enum category)
+{
+	// Events with a lower priority are dropped first
+	switch (category)
+	{
+	case EventCategory::Design:
+		return 0;
+	case EventCategory::Progression:
+		return 1;
+	case EventCategory::SessionStart:
+	case EventCategory::SessionEnd:
+		return 2;
+	default:
+		assert(false);
+		return 0;
+	}
+}
+
+unsigned int GameAnalytics::GetNumDroppedEvents(EventCategory::Enum category) const
+{
+	assert(category >= 0 && category < EventCategory::Count);
+	return numDroppedEvents[category];
+}
+
+unsigned int GameAnalytics::GetNumDroppedEvents() const
+{
+	unsigned int numDropped = 0;
+	for (int i = 0; i < EventCategory::Count; ++i)
+		numDropped += numDroppedEvents[i];
+	return numDropped;
+}
+
+unsigned int GameAnalytics::GetNumEvictedEvents() const
+{
+	// Counted by the database while it stores events, also when the hybrid store spills them
+	return analyticsDatabase.GetNumEvictedEvents();
+}
+
+template<typename Func>
+void GameAnalytics::QueueEventsToThread(size_t count, Func fillRecord)
+{
+	assert(isInitialized);
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	// Big batches are split up, so they don't have to wait for the queue to be completely empty.
+	// Tiny queues still take one event at a time.
+	const size_t maxBatchSize = std::max<size_t>(1, eventQueue->GetCapacity() / 4);
+	for (size_t offset = 0; offset < count; )
+	{
+		const size_t batchSize = std::min(count - offset, maxBatchSize);
+		auto fill = [&fillRecord, offset](EventRecord& outRecord, size_t index) {
+			fillRecord(outRecord, offset + index);
+		};
+
+		while (!eventQueue->TryPushRange(batchSize, fill))
+		{
+			if (overflowPolicy != OverflowPolicy::Block)
+			{
+				// No room for the whole batch, queue the events one by one so the overflow policy is applied to each of them
+				for (size_t i = 0; i < batchSize; ++i)
+				{
+					EventRecord record;
+					fill(record, i);
+					PushEventToThread(record);
+				}
+				break;
+			}
+
+			// Queue is full, make sure the thread is draining it and try again
+			WakeThread();
+			std::this_thread::yield();
+		}
+		offset += batchSize;
+	}
+	WakeThread();
+}
+
+GameAnalytics::StagingBuffer* GameAnalytics::GetThreadStagingBuffer()
+{
+	if (threadStagingBuffer.instanceId == instanceId)
+		return static_cast<StagingBuffer*>(threadStagingBuffer.buffer);
+
+	std::lock_guard<std::mutex> lock(stagingBuffersMutex);
+	std::unique_ptr<StagingBuffer>& buffer = stagingBuffers[std::this_thread::get_id()];
+	if (!buffer)
+		buffer.reset(new StagingBuffer(threadStagingBufferSize));
+
+	threadStagingBuffer.instanceId = instanceId;
+	threadStagingBuffer.buffer = buffer.get();
+	return buffer.get();
+}
+
+void GameAnalytics::StageEvent(const EventRecord& record)
+{
+	assert(isInitialized);
+	assert(std::this_thread::get_id() != threadHandle.get_id());
+
+	StagingBuffer& buffer = *GetThreadStagingBuffer();
+	bool isFull;
+	{
+		std::lock_guard<std::mutex> lock(buffer.mutex);
+		buffer.records[buffer.numRecords++] = record;
+		isFull = (buffer.numRecords == buffer.records.size());
+	}
+
+	if (isFull)
+		FlushStagingBuffer(buffer);
+}
+
+void GameAnalytics::FlushStagingBuffer(StagingBuffer& buffer)
+{
+	// Queued while holding the lock, so the events of this buffer can't be overtaken by the ones staged next
+	std::lock_guard<std::mutex> lock(buffer.mutex);
+	if (buffer.numRecords > 0)
+	{
+		const EventRecord* records = buffer.records.data();
+		QueueEventsToThread(buffer.numRecords, [records](EventRecord& outRecord, size_t index) {
+			outRecord = records[index];
+		});
+		buffer.numRecords = 0;
+	}
+}
+
+void GameAnalytics::FlushAllStagingBuffers()
+{
+	if (threadStagingBufferSize == 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(stagingBuffersMutex);
+	for (auto itr = stagingBuffers.begin(); itr != stagingBuffers.end(); ++itr)
+		FlushStagingBuffer(*itr->second);
+}
+
+void GameAnalytics::WakeThread()
+{
+	// Only take the lock when the thread is actually sleeping, so producers don't contend on it
+	std::atomic_thread_fence(std::memory_order_seq_cst); // Pairs with the fence in ThreadedFunction()
+	if (isThreadWaiting.exchange(false))
 	{
 		std::lock_guard<std::mutex> lock(threadMutex);
-		threadQueue.push(func);
+		threadCondition.notify_one();
 	}
-	threadCondition.notify_one();
 }
 
 void GameAnalytics::OnHTTPRequestCompletedThreadSafe(const std::string& bodyData, int userData, int statusCode)
@@ -563,6 +1582,12 @@ void GameAnalytics::OnCurlHTTPRequestCompleted(const std::string& bodyData, int
 					analyticsSendTimer = analyticsSendInterval;
 
 					restInitialized = true;
+
+					if (!hybridEventStore.SetConnected(true))
+					{
+						assert(false);
+						hasErrorHappened = true;
+					}
 				}
 			}
 		}
@@ -574,23 +1599,29 @@ void GameAnalytics::OnCurlHTTPRequestCompleted(const std::string& bodyData, int
 		switch (statusCode)
 		{
 		case 413:
-			// Unflag database events so they will be sent again
+			// Release the batch so it will be sent again, without the payload that was too large
 			maxEventBatchSize /= 2; // Send less events next time
 			if (maxEventBatchSize < 1) maxEventBatchSize = 1;
-			analyticsDatabase.UnflagEvents(userData);
+			if (!ReleaseRejectedEvents(userData))
+				hasErrorHappened = true;
 			break;
 
 		case 0:
-			// This status code is used when user is offline
-			analyticsDatabase.UnflagEvents(userData);
+			// This status code is used when user is offline, the batch is sent again as it is without counting an attempt
+			eventStore->ReleaseEvents(userData);
 
 			// Lost/no connection so disable event sending
 			// #TODO: Try to check for internet connection again after a while
 			restInitialized = false;
+			if (!hybridEventStore.SetConnected(false))
+			{
+				assert(false);
+				hasErrorHappened = true;
+			}
 			break;
 
 		default:
-			analyticsDatabase.DeleteFlaggedEvents(userData);
+			eventStore->DeleteLeasedEvents(userData);
 			break;
 		}
 	}
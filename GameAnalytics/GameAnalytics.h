@@ -1,12 +1,22 @@
 #pragma once
 
 #include <thread>
-#include <queue>
 #include <mutex>
 #include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <unordered_map>
 
 #include "GameAnalyticsDatabase.h"
+#include "SegmentedEventLog.h"
+#include "HybridEventStore.h"
 #include "WebRequestHandler.h"
+#include "LockFreeQueue.h"
+#include "EventIdRegistry.h"
+#include "EventEncoder.h"
+#include "EventSchema.h"
 
 namespace Json
 {
@@ -30,11 +40,116 @@ namespace Analytics
 			static std::string ToString(Enum value);
 		};
 
+		struct EventCategory
+		{
+			enum Enum
+			{
+				SessionStart,
+				SessionEnd,
+				Design,
+				Progression,
+
+				Count
+			};
+		};
+
+		// What to do with new events when the event queue is full
+		struct OverflowPolicy
+		{
+			enum Enum
+			{
+				Block,			// Wait until the analytics thread made room
+				DropNewest,		// Drop the new event
+				DropOldest,		// Drop the oldest queued event
+				DropByCategory,	// Drop the oldest queued event when it has a less important category than the new event, otherwise drop the new event
+			};
+		};
+
+		// Used to send many events at once with SendDesignEvents()
+		struct DesignEvent
+		{
+			DesignEvent() : hasValue(false), value(0.0f) {}
+			explicit DesignEvent(EventHandle eventId) : eventId(eventId), hasValue(false), value(0.0f) {}
+			DesignEvent(EventHandle eventId, float value) : eventId(eventId), hasValue(true), value(value) {}
+
+			EventHandle eventId;
+			bool hasValue;
+			float value;
+		};
+
+		// Used to send many events at once with SendProgressionEvents()
+		struct ProgressionEvent
+		{
+			ProgressionEvent() : status(ProgressionStatus::Start), hasScore(false), score(0) {}
+			ProgressionEvent(ProgressionStatus::Enum status, EventHandle eventId) : status(status), eventId(eventId), hasScore(false), score(0) {}
+			ProgressionEvent(ProgressionStatus::Enum status, EventHandle eventId, int score) : status(status), eventId(eventId), hasScore(true), score(score) {}
+
+			ProgressionStatus::Enum status;
+			EventHandle eventId;
+			bool hasScore;
+			int score;
+		};
+
 		struct InitData
 		{
+			InitData() : threadStagingBufferSize(0), eventQueueCapacity(8192), overflowPolicy(OverflowPolicy::Block), updateFromThread(false), threadUpdateInterval(0.1f), sessionCheckpointInterval(10.0f), maxCommitLatency(0.5f), maxCommitBatchSize(1024), durabilityProfile(DurabilityProfile::Balanced), eventStore(EventStoreType::Database), eventLogSegmentSize(4 * 1024 * 1024), maxEventsInMemory(0), maxStoredEvents(0), maxStoredEventBytes(0), evictionPolicy(EvictionPolicy::OldestFirst), reclaimFreePageThreshold(256), reclaimTimeSlice(0.002f) {}
+
 			std::string databaseFileName;
 			std::string buidName;
 			std::string userId;
+
+			// When not 0, every thread collects this many events before handing them to the analytics thread at once.
+			// Staged events are also handed over on every Update() (or threadUpdateInterval with updateFromThread) and by FlushThreadEvents().
+			size_t threadStagingBufferSize;
+
+			// Maximum number of events waiting for the analytics thread, rounded up to a power of two.
+			// Session events are never dropped, they always wait for room when the queue is full.
+			size_t eventQueueCapacity;
+			OverflowPolicy::Enum overflowPolicy;
+
+			// When true the analytics thread sends events, handles web requests and takes the staged events by itself every
+			// threadUpdateInterval seconds, so Update() doesn't have to be called. Otherwise this happens on every Update() call.
+			bool updateFromThread;
+			float threadUpdateInterval;
+
+			// How often the time of the last event of the session is stored, in seconds. When the game crashes
+			// the session is ended at that time on the next Init(), so at most this much of the session is lost.
+			float sessionCheckpointInterval;
+
+			// Events that the analytics thread stores at once are written in a single transaction. It is committed when the
+			// thread has no more events to store, or earlier when it has been open for maxCommitLatency seconds or holds
+			// maxCommitBatchSize events. That is the most that can be lost when the game crashes while storing events.
+			float maxCommitLatency;
+			unsigned int maxCommitBatchSize;
+
+			// See DurabilityProfile for what can be lost with each profile
+			DurabilityProfile::Enum durabilityProfile;
+
+			// Where events are kept until they are sent. The segmented log is named after databaseFileName and starts a new
+			// segment file every eventLogSegmentSize bytes, segments are deleted once all their events were sent.
+			EventStoreType::Enum eventStore;
+			size_t eventLogSegmentSize;
+
+			// When not 0, events are kept in memory while they are sent as fast as they come in. They are only stored when
+			// more than this many are waiting, while there is no connection, and when the analytics thread stops.
+			// Events in memory are lost when the game crashes, and the ones that are being sent when the thread stops.
+			size_t maxEventsInMemory;
+
+			// Limits the events that are stored in the database while they can't be sent, 0 means no limit. The bytes
+			// only count the encoded events. When either limit is exceeded events are evicted as set by evictionPolicy,
+			// session events and events that are being sent are never evicted, so they can exceed the limits on their own.
+			// Events that are kept in memory, see maxEventsInMemory, are not counted.
+			// The segmented log has no limits, so they can't be combined with EventStoreType::SegmentedLog.
+			long long maxStoredEvents;
+			long long maxStoredEventBytes;
+			EvictionPolicy::Enum evictionPolicy;
+
+			// When more than reclaimFreePageThreshold pages of 4 KiB in the database are free, the analytics thread gives them
+			// back to the file system while it has nothing else to do. It does so for at most reclaimTimeSlice seconds at a time,
+			// plus the one step that is running, so new events are stored without waiting long. Only for new databases and
+			// databases of older versions that are small at Init(), see the readme.
+			unsigned int reclaimFreePageThreshold;
+			float reclaimTimeSlice;
 		};
 
 		GameAnalytics(const std::string& secretKey, const std::string& gameId);
@@ -49,27 +164,125 @@ namespace Analytics
 		void SendSessionStartEvent();
 		void SendSessionEndEvent();
 
+		// Registered event ids can be sent by handle, which avoids copying the id for every event
+		EventHandle RegisterEventId(const std::string& eventId);
+
 		void SendDesignEvent(const std::string& eventId, float value);
 		void SendDesignEvent(const std::string& eventId);
+		void SendDesignEvent(EventHandle eventId, float value);
+		void SendDesignEvent(EventHandle eventId);
+
+		// Ids made with GA_DESIGN_EVENT_ID() are checked at compile time and are written without any conversion
+		void SendDesignEvent(const StaticDesignEventId& eventId, float value);
+		void SendDesignEvent(const StaticDesignEventId& eventId);
 
 		void SendProgressionEvent(ProgressionStatus::Enum status, const std::string& eventId);
 		void SendProgressionEvent(ProgressionStatus::Enum status, const std::string& eventId, const int score);
+		void SendProgressionEvent(ProgressionStatus::Enum status, EventHandle eventId);
+		void SendProgressionEvent(ProgressionStatus::Enum status, EventHandle eventId, const int score);
+
+		// Ids made with GA_PROGRESSION_EVENT_ID()
+		void SendProgressionEvent(ProgressionStatus::Enum status, const StaticProgressionEventId& eventId);
+		void SendProgressionEvent(ProgressionStatus::Enum status, const StaticProgressionEventId& eventId, const int score);
+
+		// Queues all events at once and stores them in a single database transaction
+		void SendDesignEvents(const DesignEvent* events, size_t count);
+		void SendProgressionEvents(const ProgressionEvent* events, size_t count);
+
+		// Number of events that were dropped because the event queue was full
+		unsigned int GetNumDroppedEvents(EventCategory::Enum category) const;
+		unsigned int GetNumDroppedEvents() const;
+
+		// Number of stored events that were evicted since Init() because InitData::maxStoredEvents or maxStoredEventBytes was exceeded
+		unsigned int GetNumEvictedEvents() const;
+
+		// Hands the events staged by the calling thread to the analytics thread and frees its staging buffer, call this before a thread exits
+		void FlushThreadEvents();
+
+	private:
+		// Fixed size record that is queued for every event, so sending an event doesn't allocate
+		struct EventRecord
+		{
+			static const size_t MaxEventIdLength = EventSchema::MaxEventIdLength; // Fits every valid event id
+
+			EventCategory::Enum category;
+			ProgressionStatus::Enum progressionStatus;
+			bool hasValue;
+			bool hasScore;
+			float value;
+			int score;
+			EventHandle eventHandle; // When valid, eventId is not used
+			const char* staticEventId; // When set, eventHandle and eventId are not used
+			const char* staticQuotedEventId; // Event id written to the event, including the status for progression events
+			long long clientTimestamp; // Taken when the event is sent, not when the thread gets to it
+			char eventId[MaxEventIdLength + 1];
+		};
+
+		// Events that are collected by a single thread, see InitData::threadStagingBufferSize
+		struct StagingBuffer
+		{
+			explicit StagingBuffer(size_t capacity) : records(capacity), numRecords(0) {}
+
+			std::mutex mutex; // Only contended when another thread flushes this buffer, which can wait for room in the queue
+			std::vector<EventRecord> records;
+			size_t numRecords;
+		};
 
 	private:
 		// This all runs in separate thread
 		void ThreadedFunction();
+		void InitializeFromThread();
+		void RunQueuedFunctions();
+		void UpdateFromThread(float delta);
+		void OnSendTimerElapsed();
+		void ProcessEvent(const EventRecord& record);
+		void ProcessStagedEvents();
+		void CommitEvents();
+		bool ReclaimFreePages(); // Returns true when there are free pages left to reclaim
+		void ProcessSessionStartEvent(const EventRecord& record);
+		void ProcessSessionEndEvent(const EventRecord& record);
+		void ProcessDesignEvent(const EventRecord& record);
+		void ProcessProgressionEvent(const EventRecord& record);
+		const char* GetRecordEventId(const EventRecord& record) const;
 
-		void GenerateDefaultAnnotations(Json::Value& outAnnotations);
-		bool AddGameAnalyticsEvent(const Json::Value& eventData);
+		const std::string& GetDefaultAnnotations();
+		void SetCurrentProgression(const char* progressionEventId);
+		EventEncoder& BeginGameAnalyticsEvent(EventCategory::Enum category, long long clientTimestamp);
+		bool EndGameAnalyticsEvent();
+		bool StoreGameAnalyticsEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, EventCategory::Enum category);
+		bool CheckpointSession();
+		static const char* GetCategoryName(EventCategory::Enum category);
 		bool SendCachedGameAnalyticsEvents();
+		bool ReleaseRejectedEvents(int requestId);
 		int GetAndUpdateProgressionAttempts(ProgressionStatus::Enum status, const char* progressionEventId);
+		bool LoadProgressionAttempts();
+		bool StoreProgressionAttempts();
 		bool EndUnendedSessions();
 
 	private:
 		// This all runs in main thread
 		bool SendToGameAnalytics(const std::string& route, const std::string& eventData, const std::string& hMacAuth, int requestId);
 	public:
+		// Never blocks the caller, functions that don't fit in the queue wait in a list until the thread gets to them
 		void QueueFunctionToThread(std::function<void()> func);
+	private:
+		static void InitEventRecord(EventRecord& outRecord, EventCategory::Enum category);
+		static bool SetRecordEventId(EventRecord& outRecord, const std::string& eventId);
+		bool SetRecordEventId(EventRecord& outRecord, EventHandle eventId) const;
+		static void SetRecordEventId(EventRecord& outRecord, const StaticDesignEventId& eventId);
+		static void SetRecordEventId(EventRecord& outRecord, ProgressionStatus::Enum status, const StaticProgressionEventId& eventId);
+		void QueueEventToThread(const EventRecord& record);
+		void PushEventToThread(const EventRecord& record);
+		bool HandleQueueOverflow(EventCategory::Enum category);
+		static int GetCategoryPriority(EventCategory::Enum category);
+		template<typename Func>
+		void QueueEventsToThread(size_t count, Func fillRecord);
+
+		StagingBuffer* GetThreadStagingBuffer();
+		void StageEvent(const EventRecord& record);
+		void FlushStagingBuffer(StagingBuffer& buffer);
+		void FlushAllStagingBuffers();
+		void WakeThread();
 
 	private:
 		// These are shared between threads
@@ -77,11 +290,27 @@ namespace Analytics
 		std::atomic<bool> hasErrorHappened;
 		std::atomic<bool> shouldStopThread;
 		std::thread threadHandle;
-		std::queue< std::function<void()> > threadQueue;
-		mutable std::mutex threadMutex;
+		LockFreeQueue< std::function<void()> > threadQueue;
+		std::mutex overflowFunctionsMutex;
+		std::deque< std::function<void()> > overflowFunctions; // Functions that didn't fit in threadQueue, only accessed while holding overflowFunctionsMutex
+		std::atomic<bool> hasOverflowFunctions; // New functions go to overflowFunctions until it's empty, so they stay in order
+		std::unique_ptr< LockFreeQueue<EventRecord> > eventQueue;
+		OverflowPolicy::Enum overflowPolicy;
+		std::atomic<unsigned int> numDroppedEvents[EventCategory::Count];
+		mutable std::mutex threadMutex; // Only used to start the thread, put it to sleep and wake it up
 		std::condition_variable threadCondition;
+		std::atomic<bool> isThreadWaiting;
+		bool updateFromThread;
+		std::chrono::steady_clock::duration threadUpdateInterval;
 		std::atomic<bool> restInitialized;
 		const std::string secretKey, gameId;
+		EventIdRegistry eventIdRegistry;
+
+		const unsigned int instanceId;
+		static std::atomic<unsigned int> nextInstanceId;
+		size_t threadStagingBufferSize;
+		std::mutex stagingBuffersMutex;
+		std::unordered_map< std::thread::id, std::unique_ptr<StagingBuffer> > stagingBuffers; // Only accessed while holding stagingBuffersMutex
 
 		// Can only access in thread
 		int sessionNumber;
@@ -89,6 +318,16 @@ namespace Analytics
 		long long serverTimeDifference;
 
 		long long sessionStartTimestamp;
+		long long lastEventTimestamp;
+		bool isSessionCheckpointDirty; // Session has events that are newer than the stored checkpoint
+		std::chrono::steady_clock::duration sessionCheckpointInterval;
+		std::chrono::steady_clock::time_point lastSessionCheckpointTime;
+		std::vector<EventRecord> stagedRecords; // Taken out of the staging buffers by ProcessStagedEvents()
+		bool isCommitOpen; // Transaction is open for the events that are being stored
+		unsigned int numUncommittedEvents;
+		std::chrono::steady_clock::time_point commitOpenTime;
+		unsigned int maxCommitBatchSize;
+		std::chrono::steady_clock::duration maxCommitLatency;
 		std::string sessionId;
 		std::string hashedUserId;
 		std::string osVersion;
@@ -97,14 +336,46 @@ namespace Analytics
 		std::string buildName;
 		std::string currentProgressionEventId;
 
+		// Attempts of the progressions that were not completed yet, loaded at Init. Changed entries are
+		// written to the database on the send interval and at shutdown, entries without attempts are deleted.
+		struct ProgressionAttempts
+		{
+			ProgressionAttempts() : numAttempts(0), isDirty(false) {}
+
+			int numAttempts;
+			bool isDirty;
+		};
+		std::unordered_map<std::string, ProgressionAttempts> progressionAttempts;
+		bool hasDirtyProgressionAttempts;
+		std::string defaultAnnotations; // Serialized annotations that are the same for every event, empty when they have to be regenerated
+		EventEncoder eventEncoder; // Only used by the thread, reused for every event
+		long long eventClientTimestamp; // Of the event in eventEncoder
+		EventCategory::Enum eventCategory;
+
 		float analyticsSendTimer;
 		const float analyticsSendInterval; // In seconds
+		const float clockCalibrationInterval; // In seconds
+		const long long maxPayloadTimeDrift; // In seconds, stored payloads are rebuilt when the server time changed more than this
+		const int maxBatchAttempts; // Batches that the server rejected this often are dropped, eg. when a single event is too large
 
 		int httpRequestCounter;
 		int maxEventBatchSize;
 
 		std::string dbFileName;
+		DurabilityProfile::Enum durabilityProfile;
+		long long maxStoredEvents;
+		long long maxStoredEventBytes;
+		EvictionPolicy::Enum evictionPolicy;
+		unsigned int reclaimFreePageThreshold;
+		std::chrono::steady_clock::duration reclaimTimeSlice;
+		bool isReclaimingFreePages; // Until no free pages are left
 		GameAnalyticsDatabase analyticsDatabase;
+		SegmentedEventLog eventLog;
+		EventStoreType::Enum eventStoreType;
+		size_t eventLogSegmentSize;
+		HybridEventStore hybridEventStore; // Keeps events in memory before the database or log
+		size_t maxEventsInMemory;
+		IEventStore* eventStore; // One of the stores above
 		WebRequestHandler requestHandler;
 
 	public:
@@ -1,26 +1,151 @@
 #include "GameAnalyticsDatabase.h"
 
-#include <json/json.h>
+#include "EventEncoder.h"
+#include "EventWriter.h"
+
 #include <sqlite/sqlite3.h>
+#include <json/json.h>
 
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <assert.h>
+#include <algorithm>
+#include <climits>
+#include <cstdio>
 
 using namespace Analytics;
 
+namespace
+{
+	// Resets a cached statement when it goes out of scope, so it can be used again with new bindings
+	class ScopedStatement
+	{
+	public:
+		explicit ScopedStatement(sqlite3_stmt* statement) : statement(statement) {}
+		~ScopedStatement()
+		{
+			// Statement is NULL when the database isn't initialized, sqlite fails every call with it in that case
+			if (statement == NULL)
+				return;
+
+			sqlite3_reset(statement);
+			sqlite3_clear_bindings(statement);
+		}
+
+		operator sqlite3_stmt*() const { return statement; }
+
+	private:
+		sqlite3_stmt* statement;
+	};
+
+	// Events stored as json by older versions only need their client_ts changed. The key can't be found inside a string,
+	// where its closing quote would have to be escaped, so the first one is the actual key.
+	bool AppendJsonEvent(std::string& outJson, const char* json, size_t size, long long clientTimestampOffset)
+	{
+		static const char clientTimestampKey[] = "\"client_ts\":";
+
+		// Events that were written by Json::FastWriter end with a new line
+		const char* end = json + size;
+		while (end != json && end[-1] == '\n')
+			--end;
+
+		const char* value = std::search(json, end, clientTimestampKey, clientTimestampKey + sizeof(clientTimestampKey) - 1);
+		if (value == end)
+			return false;
+		value += sizeof(clientTimestampKey) - 1;
+
+		const char* current = value;
+		const bool isNegative = (current != end && *current == '-');
+		if (isNegative)
+			++current;
+
+		const char* digits = current;
+		long long clientTimestamp = 0;
+		for (; current != end && *current >= '0' && *current <= '9'; ++current)
+			clientTimestamp = clientTimestamp * 10 + (*current - '0');
+		if (current == digits)
+			return false;
+
+		if (isNegative)
+			clientTimestamp = -clientTimestamp;
+
+		outJson.append(json, value);
+		outJson += std::to_string(clientTimestamp + clientTimestampOffset);
+		outJson.append(current, end);
+		return true;
+	}
+}
+
+// Has to be in the same order as GameAnalyticsDatabase::Statement
+const char* const GameAnalyticsDatabase::statementQueries[Statement::Count] =
+{
+	"SELECT value FROM key_value WHERE key = ?;", // GetKeyValuePair
+	"INSERT OR REPLACE INTO key_value(key, value) VALUES(?, ?);", // SetKeyValuePair
+	"INSERT INTO `events` (`annotations_id`, `data`, `client_ts`, `priority`) VALUES (?, ?, ?, ?);", // AddEvent
+	"BEGIN TRANSACTION;", // BeginTransaction
+	"COMMIT TRANSACTION;", // CommitTransaction
+	// All event queries are range scans over the id, which is the key of the table
+	"SELECT COUNT(*), MIN(`id`), MAX(`id`) FROM (SELECT `id` FROM `events` WHERE `id` > ? AND `id` <= ? ORDER BY `id` ASC LIMIT ?);", // GetEventRange
+	"SELECT `annotations_id`, `data`, `client_ts` FROM `events` WHERE `id` BETWEEN ? AND ? ORDER BY `id` ASC;", // RetrieveEvents
+	"DELETE FROM `events` WHERE `id` BETWEEN ? AND ?;", // DeleteEvents
+	"SELECT COUNT(*), TOTAL(LENGTH(`data`)) FROM `events` WHERE `id` BETWEEN ? AND ?;", // GetEventRangeSize
+	// Events that were found to be unevictable before are skipped by the range over the id. Evicting one priority at a time
+	// uses the index on the priority and the id, which only exists for EvictionPolicy::LowestPriorityFirst.
+	"SELECT `id`, LENGTH(`data`) FROM `events` WHERE `id` > ? AND `priority` <= ? ORDER BY `id` ASC;", // GetEvictableEvents
+	"SELECT `id`, LENGTH(`data`) FROM `events` WHERE `priority` = ? AND `id` > ? ORDER BY `id` ASC;", // GetEvictableEventsOfPriority
+	"DELETE FROM `events` WHERE `id` = ?;", // DeleteEvent
+	"PRAGMA freelist_count;", // GetNumFreePages
+	// Reclaiming 64 pages of 4 KiB usually takes a fraction of a millisecond, a few milliseconds when it causes a checkpoint
+	"PRAGMA incremental_vacuum(64);", // ReclaimFreePages
+	"INSERT INTO `annotations` (`members`) VALUES (?);", // AddAnnotations
+	"SELECT `members` FROM `annotations` WHERE `id` = ?;", // GetAnnotations
+	// Annotations before the ones of the oldest event are not used anymore, the latest ones are kept when there are no events
+	"DELETE FROM `annotations` WHERE `id` < IFNULL((SELECT `annotations_id` FROM `events` ORDER BY `id` ASC LIMIT 1), ?);", // DeleteUnusedAnnotations
+	"SELECT `first_event_id`, `last_event_id` FROM `batches`;", // GetAllBatches
+	// Replacing a batch also clears its payload, which doesn't match the new range
+	"INSERT OR REPLACE INTO `batches` (`first_event_id`, `last_event_id`) VALUES(?, ?);", // SetBatch
+	"SELECT `payload`, `hmac`, `server_time_difference` FROM `batches` WHERE `first_event_id` = ? AND `payload` IS NOT NULL;", // GetBatchPayload
+	"UPDATE `batches` SET `payload` = ?, `hmac` = ?, `server_time_difference` = ? WHERE `first_event_id` = ?;", // SetBatchPayload
+	"UPDATE `batches` SET `payload` = NULL, `hmac` = NULL, `server_time_difference` = NULL WHERE `first_event_id` = ?;", // ClearBatchPayload
+	"UPDATE `batches` SET `attempts` = `attempts` + 1 WHERE `first_event_id` = ?;", // AddBatchAttempt
+	"SELECT `attempts` FROM `batches` WHERE `first_event_id` = ?;", // GetBatchAttempts
+	"DELETE FROM `batches` WHERE `first_event_id` = ?;", // DeleteBatch
+	"SELECT `progression_event_id`, `attempt_num` FROM `progression`;", // GetAllProgressionAttempts
+	"INSERT OR REPLACE INTO `progression` (`progression_event_id`, `attempt_num`) VALUES(?, ?);", // SetProgressionAttempts
+	"DELETE FROM `progression` WHERE `progression_event_id` = ?;", // DeleteProgressionAttempts
+	"SELECT `session_start_ts`, `last_event_ts`, `session_id`, `default_annotations` FROM session_end;", // GetAllSessionEnds
+	"INSERT OR REPLACE INTO `session_end` (`session_start_ts`, `session_id`, `last_event_ts`, `default_annotations`) VALUES(?, ?, ?, ?);", // SetSessionEnd
+	"DELETE FROM `session_end` WHERE `session_id` = ?;", // DeleteSessionEnd
+};
+
 GameAnalyticsDatabase::GameAnalyticsDatabase()
 	: database(NULL)
+	, transactionDepth(0)
+	, lastLeasedEventId(0)
+	, maxStoredEvents(0)
+	, maxStoredBytes(0)
+	, evictionPolicy(EvictionPolicy::OldestFirst)
+	, maxEvictedPriority(0)
+	, numStoredEvents(0)
+	, numStoredBytes(0)
+	, numEvictedEvents(0)
+	, lastAddedEventId(0)
+	, lastUnevictableEventId(0)
+	, canReclaimFreePages(false)
+	, lastAnnotationsId(0)
 {
+	for (int i = 0; i < Statement::Count; ++i)
+		statements[i] = NULL;
 }
 
 GameAnalyticsDatabase::~GameAnalyticsDatabase()
 {
+	FinalizeStatements();
 	sqlite3_close(database);
 	database = NULL;
 }
 
-Result::Enum GameAnalyticsDatabase::Initialize(const char* databaseFile)
+Result::Enum GameAnalyticsDatabase::Initialize(const char* databaseFile, DurabilityProfile::Enum durabilityProfile)
 {
 	int rc = sqlite3_open(databaseFile, &database);
 	if (rc != SQLITE_OK)
@@ -33,43 +158,80 @@ Result::Enum GameAnalyticsDatabase::Initialize(const char* databaseFile)
 		return Result::DatabaseIsReadonly;
 	}
 
+	ApplyDurabilityProfile(durabilityProfile);
+	canReclaimFreePages = EnableIncrementalVacuum();
+
 	{
-		// Make sure all this matches with CreateDatabaseTables()
+		// Make sure the columns match with the create statements
 		tableStructures.clear();
 
 		TableDescription eventsTableStructure;
 		eventsTableStructure.tableName = "events";
-		//eventsTableStructure.columns.push_back(ColumnDescription("id", "INTEGER", true, true));
-		eventsTableStructure.columns.push_back(ColumnDescription("json", "TEXT", true));
-		eventsTableStructure.columns.push_back(ColumnDescription("is_sent", "INTEGER", true));
+		// Ids are never reused, so new events always come after the leased ones
+		// Client_ts is NULL for events of older versions, their data still has it
+		eventsTableStructure.createStatement = "CREATE TABLE `events` (`id` INTEGER PRIMARY KEY AUTOINCREMENT, `annotations_id` INTEGER NOT NULL, `data` BLOB NOT NULL, `client_ts` INTEGER, `priority` INTEGER NOT NULL DEFAULT 0);";
+		eventsTableStructure.columns.push_back(ColumnDescription("id", "INTEGER", false, true));
+		eventsTableStructure.columns.push_back(ColumnDescription("annotations_id", "INTEGER", true));
+		eventsTableStructure.columns.push_back(ColumnDescription("data", "BLOB", true));
+		eventsTableStructure.columns.push_back(ColumnDescription("client_ts", "INTEGER"));
+		eventsTableStructure.columns.push_back(ColumnDescription("priority", "INTEGER", true, false, true, 0));
 		tableStructures.push_back(eventsTableStructure);
 
+		// The default annotations are shared by all events that were sent with them
+		TableDescription annotationsTableStructure;
+		annotationsTableStructure.tableName = "annotations";
+		annotationsTableStructure.createStatement = "CREATE TABLE `annotations` (`id` INTEGER PRIMARY KEY AUTOINCREMENT, `members` TEXT NOT NULL);";
+		annotationsTableStructure.columns.push_back(ColumnDescription("id", "INTEGER", false, true));
+		annotationsTableStructure.columns.push_back(ColumnDescription("members", "TEXT", true));
+		tableStructures.push_back(annotationsTableStructure);
+
+		TableDescription batchesTableStructure;
+		batchesTableStructure.tableName = "batches";
+		batchesTableStructure.createStatement = "CREATE TABLE `batches` (`first_event_id` INTEGER PRIMARY KEY, `last_event_id` INTEGER NOT NULL, `payload` BLOB, `hmac` TEXT, `server_time_difference` INTEGER, `attempts` INTEGER NOT NULL DEFAULT 0);";
+		batchesTableStructure.columns.push_back(ColumnDescription("first_event_id", "INTEGER", false, true));
+		batchesTableStructure.columns.push_back(ColumnDescription("last_event_id", "INTEGER", true));
+		batchesTableStructure.columns.push_back(ColumnDescription("payload", "BLOB"));
+		batchesTableStructure.columns.push_back(ColumnDescription("hmac", "TEXT"));
+		batchesTableStructure.columns.push_back(ColumnDescription("server_time_difference", "INTEGER"));
+		batchesTableStructure.columns.push_back(ColumnDescription("attempts", "INTEGER", true, false, true, 0));
+		tableStructures.push_back(batchesTableStructure);
+
 		TableDescription keyValueTableStructure;
 		keyValueTableStructure.tableName = "key_value";
+		keyValueTableStructure.createStatement = "CREATE TABLE `key_value` (`key` TEXT NOT NULL UNIQUE, `value` INTEGER, PRIMARY KEY(key));";
 		keyValueTableStructure.columns.push_back(ColumnDescription("key", "TEXT", true, true));
 		keyValueTableStructure.columns.push_back(ColumnDescription("value", "INTEGER"));
 		tableStructures.push_back(keyValueTableStructure);
 
 		TableDescription progressionTableStructure;
 		progressionTableStructure.tableName = "progression";
+		progressionTableStructure.createStatement = "CREATE TABLE `progression` (`progression_event_id` TEXT NOT NULL UNIQUE, `attempt_num` INTEGER NOT NULL DEFAULT 0, PRIMARY KEY(progression_event_id));";
 		progressionTableStructure.columns.push_back(ColumnDescription("progression_event_id", "TEXT", true, true, false));
 		progressionTableStructure.columns.push_back(ColumnDescription("attempt_num", "INTEGER", true, false, true, 0));
 		tableStructures.push_back(progressionTableStructure);
 
 		TableDescription sessionEndTableStructure;
 		sessionEndTableStructure.tableName = "session_end";
+		sessionEndTableStructure.createStatement = "CREATE TABLE `session_end` (`session_start_ts` INTEGER NOT NULL, `session_id` TEXT NOT NULL UNIQUE, `last_event_ts` INTEGER NOT NULL, `default_annotations` TEXT NOT NULL, PRIMARY KEY(session_id));";
 		sessionEndTableStructure.columns.push_back(ColumnDescription("session_start_ts", "INTEGER", true));
 		sessionEndTableStructure.columns.push_back(ColumnDescription("session_id", "TEXT", true, true));
-		sessionEndTableStructure.columns.push_back(ColumnDescription("last_event_default_annotations", "TEXT", true));
+		sessionEndTableStructure.columns.push_back(ColumnDescription("last_event_ts", "INTEGER", true));
+		sessionEndTableStructure.columns.push_back(ColumnDescription("default_annotations", "TEXT", true));
 		tableStructures.push_back(sessionEndTableStructure);
 	}
 
-	if (!ValidateTableStructures())
+	// Databases of the first versions don't have a schema version, they are migrated first so the stored events are kept
+	int schemaVersion = 0;
+	if (GetSchemaVersion(schemaVersion) && schemaVersion == 0)
+		MigrateBaselineDatabase();
+
+	// Only recreate the tables that don't match, so changing one table doesn't throw away the stored events
+	for (size_t i = 0; i < tableStructures.size(); ++i)
 	{
-		// Start with a clean database
-		DropAllTables();
+		if (ValidateTableStructure(tableStructures[i].tableName, tableStructures[i].columns))
+			continue;
 
-		if (!CreateDatabaseTables())
+		if (!RecreateTable(tableStructures[i]))
 		{
 			sqlite3_close(database);
 			database = NULL;
@@ -77,6 +239,21 @@ Result::Enum GameAnalyticsDatabase::Initialize(const char* databaseFile)
 		}
 	}
 
+	if (schemaVersion != SchemaVersion && !SetSchemaVersion(SchemaVersion))
+	{
+		sqlite3_close(database);
+		database = NULL;
+		return Result::Failed;
+	}
+
+	if (!PrepareStatements() || !LoadBatches())
+	{
+		FinalizeStatements();
+		sqlite3_close(database);
+		database = NULL;
+		return Result::Failed;
+	}
+
 	return Result::Ok;
 }
 
@@ -85,33 +262,34 @@ bool GameAnalyticsDatabase::IsInitialized() const
 	return (database != NULL);
 }
 
-bool GameAnalyticsDatabase::GetAllSessionEnds(std::vector<SessionEndData>& outSessionEndData) const
+void GameAnalyticsDatabase::DeleteDatabaseFiles(const char* databaseFile)
 {
-	std::string statementStr = "SELECT `session_start_ts`, `session_id`, `last_event_default_annotations` FROM session_end;";
+	const std::string fileName = databaseFile;
+	std::remove(fileName.c_str());
+	std::remove((fileName + "-wal").c_str());
+	std::remove((fileName + "-shm").c_str());
+}
 
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+bool GameAnalyticsDatabase::GetAllSessionEnds(std::vector<SessionEndData>& outSessionEndData) const
+{
+	ScopedStatement statement(statements[Statement::GetAllSessionEnds]);
+	int rc;
 
 	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
 	{
-		assert(sqlite3_column_count(statement) == 3);
+		assert(sqlite3_column_count(statement) == 4);
 
 		SessionEndData session;
 		session.sessionStartTimestamp = sqlite3_column_int64(statement, 0);
-		session.sessionId = (const char*)sqlite3_column_text(statement, 1);
-		session.annotations = (const char*)sqlite3_column_text(statement, 2);
+		session.lastEventTimestamp = sqlite3_column_int64(statement, 1);
+		session.sessionId = (const char*)sqlite3_column_text(statement, 2);
+		session.defaultAnnotations = (const char*)sqlite3_column_text(statement, 3);
 		outSessionEndData.push_back(session);
 	}
 
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
-		return false;
-
 	return true;
 }
 
@@ -130,14 +308,9 @@ void GameAnalyticsDatabase::SetNumSessions(int sessions)
 bool GameAnalyticsDatabase::SetKeyValuePair(const char* key, int value)
 {
 	// Updates or creates a new key with value
-	std::string statementStr = "INSERT OR REPLACE INTO key_value(key, value) VALUES(?, ?);";
-
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	ScopedStatement statement(statements[Statement::SetKeyValuePair]);
 
-	rc = sqlite3_bind_text(statement, 1, key, -1, NULL);
+	int rc = sqlite3_bind_text(statement, 1, key, -1, NULL);
 	assert(rc == SQLITE_OK);
 	rc = sqlite3_bind_int(statement, 2, value);
 	assert(rc == SQLITE_OK);
@@ -146,20 +319,14 @@ bool GameAnalyticsDatabase::SetKeyValuePair(const char* key, int value)
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	return (rc == SQLITE_OK);
+	return true;
 }
 
 bool GameAnalyticsDatabase::GetKeyValuePair(const char* key, int& outValue) const
 {
-	std::string statementStr = "SELECT value FROM key_value WHERE key = ?;";
-
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	ScopedStatement statement(statements[Statement::GetKeyValuePair]);
 
-	rc = sqlite3_bind_text(statement, 1, key, -1, NULL);
+	int rc = sqlite3_bind_text(statement, 1, key, -1, NULL);
 	assert(rc == SQLITE_OK);
 
 	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
@@ -171,371 +338,1107 @@ bool GameAnalyticsDatabase::GetKeyValuePair(const char* key, int& outValue) cons
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
-		return false;
-
 	return true;
 }
 
-bool GameAnalyticsDatabase::AddEvent(const char* eventData)
+bool GameAnalyticsDatabase::AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int priority)
 {
-	std::string statementStr = "INSERT INTO `events` (`json`) VALUES (?);";
+	if (lastAnnotationsId == 0 || defaultAnnotations != lastAnnotations)
+	{
+		if (!AddAnnotations(defaultAnnotations))
+			return false;
+	}
 
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	ScopedStatement statement(statements[Statement::AddEvent]);
 
-	rc = sqlite3_bind_text(statement, 1, eventData, -1, NULL);
+	int rc = sqlite3_bind_int64(statement, 1, lastAnnotationsId);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_blob(statement, 2, encodedEvent.data(), (int)encodedEvent.size(), NULL);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 3, clientTimestamp);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int(statement, 4, priority);
 	assert(rc == SQLITE_OK);
 
 	rc = sqlite3_step(statement);
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	return (rc == SQLITE_OK);
+	const bool wereAllUnevictable = (lastAddedEventId > 0 && lastUnevictableEventId == lastAddedEventId);
+	lastAddedEventId = sqlite3_last_insert_rowid(database);
+
+	if (!HasEventQuota())
+		return true;
+
+	++numStoredEvents;
+	numStoredBytes += (long long)encodedEvent.size();
+	if ((maxStoredEvents > 0 && numStoredEvents > maxStoredEvents) || (maxStoredBytes > 0 && numStoredBytes > maxStoredBytes))
+	{
+		// Events stay unevictable until they are deleted, so nothing can be evicted when this one can't be evicted either
+		if (wereAllUnevictable && priority > maxEvictedPriority)
+		{
+			lastUnevictableEventId = lastAddedEventId;
+			return true;
+		}
+
+		return EvictEvents();
+	}
+
+	return true;
 }
 
-bool GameAnalyticsDatabase::FlagEvents(int requestId, int amount)
+bool GameAnalyticsDatabase::SetEventQuota(long long maxEvents, long long maxBytes, EvictionPolicy::Enum policy, int maxEvictedPriority)
 {
-	// The last piece of this query makes sure it is sorted by id
-	// Change the limit to send more/less events in a single post
-	std::string updateStatementStr = "UPDATE `events` SET `is_sent` = ? WHERE `_rowid_` IN (SELECT `_rowid_` FROM `events` WHERE `is_sent` = 0 ORDER BY `_rowid_` ASC LIMIT ?)";
-	sqlite3_stmt* updateStatement = NULL;
-	int rc = sqlite3_prepare_v2(database, updateStatementStr.c_str(), -1, &updateStatement, NULL);
-	if (rc != SQLITE_OK)
+	maxStoredEvents = maxEvents;
+	maxStoredBytes = maxBytes;
+	evictionPolicy = policy;
+	this->maxEvictedPriority = maxEvictedPriority;
+
+	numStoredEvents = 0;
+	numStoredBytes = 0;
+	lastUnevictableEventId = 0; // Depends on maxEvictedPriority
+
+	// Every insert has to update the index, so it only exists while it's used
+	const bool isByPriority = (HasEventQuota() && policy == EvictionPolicy::LowestPriorityFirst);
+	const char* indexQuery = isByPriority ? "CREATE INDEX IF NOT EXISTS `events_priority` ON `events` (`priority`, `id`);" : "DROP INDEX IF EXISTS `events_priority`;";
+	char* errorMessage = NULL;
+	if (sqlite3_exec(database, indexQuery, NULL, NULL, &errorMessage) != SQLITE_OK)
+	{
+		OutputDebugStringA(errorMessage);
+		sqlite3_free(errorMessage);
 		return false;
+	}
 
-	rc = sqlite3_bind_int(updateStatement, 1, requestId);
-	assert(rc == SQLITE_OK);
-
-	rc = sqlite3_bind_int(updateStatement, 2, amount);
-	assert(rc == SQLITE_OK);
+	if (!HasEventQuota())
+		return true;
 
-	rc = sqlite3_step(updateStatement);
-	if (rc != SQLITE_DONE)
+	if (!GetEventRangeSize(LLONG_MIN, LLONG_MAX, numStoredEvents, numStoredBytes))
 		return false;
 
-	rc = sqlite3_finalize(updateStatement);
-	if (rc != SQLITE_OK)
-		return false;
+	// The quota can be smaller than the last time
+	if ((maxStoredEvents > 0 && numStoredEvents > maxStoredEvents) || (maxStoredBytes > 0 && numStoredBytes > maxStoredBytes))
+		return EvictEvents();
 
 	return true;
 }
 
-bool GameAnalyticsDatabase::UnflagEvents(int requestId)
+unsigned int GameAnalyticsDatabase::GetNumEvictedEvents() const
 {
-	std::string updateStatementStr = "UPDATE `events` SET `is_sent` = 0 WHERE `is_sent` = ?;";
-	sqlite3_stmt* updateStatement = NULL;
-	int rc = sqlite3_prepare_v2(database, updateStatementStr.c_str(), -1, &updateStatement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	return numEvictedEvents;
+}
 
-	rc = sqlite3_bind_int(updateStatement, 1, requestId);
-	assert(rc == SQLITE_OK);
+bool GameAnalyticsDatabase::BeginTransaction()
+{
+	if (transactionDepth++ > 0)
+		return true;
 
-	rc = sqlite3_step(updateStatement);
-	if (rc != SQLITE_DONE)
+	ScopedStatement statement(statements[Statement::BeginTransaction]);
+	if (sqlite3_step(statement) != SQLITE_DONE)
+	{
+		OutputDebugStringA(sqlite3_errmsg(database));
+		transactionDepth = 0;
 		return false;
+	}
+	return true;
+}
 
-	rc = sqlite3_finalize(updateStatement);
-	if (rc != SQLITE_OK)
-		return false;
+bool GameAnalyticsDatabase::CommitTransaction()
+{
+	assert(transactionDepth > 0);
+	if (transactionDepth == 0 || --transactionDepth > 0)
+		return true;
 
+	ScopedStatement statement(statements[Statement::CommitTransaction]);
+	if (sqlite3_step(statement) != SQLITE_DONE)
+	{
+		OutputDebugStringA(sqlite3_errmsg(database));
+		return false;
+	}
 	return true;
 }
 
-bool Analytics::GameAnalyticsDatabase::UnflagAllEvents()
+bool GameAnalyticsDatabase::LeaseEvents(int requestId, int amount)
 {
-	std::string updateStatementStr = "UPDATE `events` SET `is_sent` = 0;";
-	sqlite3_stmt* updateStatement = NULL;
-	int rc = sqlite3_prepare_v2(database, updateStatementStr.c_str(), -1, &updateStatement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	assert(amount > 0);
+	assert(leasedBatches.find(requestId) == leasedBatches.end());
 
-	rc = sqlite3_step(updateStatement);
-	if (rc != SQLITE_DONE)
+	// Released batches go first, they are split when less events fit in a request than before
+	while (!releasedBatches.empty())
+	{
+		const EventRange range = releasedBatches.begin()->second;
+
+		int numEvents = 0;
+		EventRange leasedRange;
+		if (!GetEventRange(range.firstEventId - 1, range.lastEventId, amount, numEvents, leasedRange))
+			return false;
+
+		if (numEvents == 0)
+		{
+			// Nothing left to send in this batch
+			if (!DeleteBatch(range.firstEventId))
+				return false;
+
+			releasedBatches.erase(releasedBatches.begin());
+			continue;
+		}
+
+		leasedRange.firstEventId = range.firstEventId;
+		if (numEvents == amount && leasedRange.lastEventId < range.lastEventId)
+		{
+			// The remainder is stored first, so its events are never outside of a batch
+			EventRange remainder;
+			remainder.firstEventId = leasedRange.lastEventId + 1;
+			remainder.lastEventId = range.lastEventId;
+
+			if (!BeginTransaction())
+				return false;
+
+			const bool isSplit = SetBatch(remainder) && SetBatch(leasedRange);
+			if (!CommitTransaction() || !isSplit)
+				return false;
+
+			releasedBatches[remainder.firstEventId] = remainder;
+		}
+
+		releasedBatches.erase(range.firstEventId);
+		leasedBatches[requestId] = leasedRange;
+		return true;
+	}
+
+	int numEvents = 0;
+	EventRange range;
+	if (!GetEventRange(lastLeasedEventId, LLONG_MAX, amount, numEvents, range))
 		return false;
 
-	rc = sqlite3_finalize(updateStatement);
-	if (rc != SQLITE_OK)
+	if (numEvents == 0)
+		return true; // Nothing to send
+
+	if (!SetBatch(range))
 		return false;
 
+	leasedBatches[requestId] = range;
+	lastLeasedEventId = range.lastEventId;
 	return true;
 }
 
-bool GameAnalyticsDatabase::RetrieveFlaggedEvents(int requestId, Json::Value& outJson, long long serverTimeDifference) const
+bool GameAnalyticsDatabase::HasLeasedEvents(int requestId) const
 {
-	// Retrieve all events that have been flagged as sent
-	std::string statementStr = "SELECT `json` FROM `events` WHERE `is_sent` = ? ORDER BY `_rowid_` ASC;";
+	return leasedBatches.find(requestId) != leasedBatches.end();
+}
 
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+bool GameAnalyticsDatabase::ReleaseEvents(int requestId)
+{
+	std::unordered_map<int, EventRange>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	// The batch is still stored, it only has to be sent again
+	releasedBatches[it->second.firstEventId] = it->second;
+	leasedBatches.erase(it);
+	return true;
+}
 
-	rc = sqlite3_bind_int(statement, 1, requestId);
+bool GameAnalyticsDatabase::RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference)
+{
+	std::unordered_map<int, EventRange>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	ScopedStatement statement(statements[Statement::RetrieveEvents]);
+
+	int rc = sqlite3_bind_int64(statement, 1, it->second.firstEventId);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 2, it->second.lastEventId);
 	assert(rc == SQLITE_OK);
 
+	// Most events in a batch share their annotations, so they are only read when they change
+	long long annotationsId = 0;
+	std::string annotations;
+	EventWriter writer;
+
 	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
 	{
-		assert(sqlite3_column_count(statement) == 1);
-		const char* text = (const char*)sqlite3_column_text(statement, 0);
+		assert(sqlite3_column_count(statement) == 3);
+		const long long eventAnnotationsId = sqlite3_column_int64(statement, 0);
+		const char* data = (const char*)sqlite3_column_blob(statement, 1);
+		const int size = sqlite3_column_bytes(statement, 1);
 
-		Json::Reader reader;
-		Json::Value root;
-		if (!reader.parse(text, root, false))
+		if (eventAnnotationsId == 0)
+		{
+			// Stored as json by an older version, its client_ts is converted to server time in place
+			const size_t length = outJson.length();
+			outJson += outJson.empty() ? '[' : ',';
+			if (!AppendJsonEvent(outJson, data, size, serverTimeDifference))
+			{
+				assert(false);
+				outJson.resize(length);
+			}
 			continue;
+		}
+
+		if (eventAnnotationsId != annotationsId)
+		{
+			annotations.clear();
+			if (!GetAnnotations(eventAnnotationsId, annotations))
+				return false;
+			annotationsId = eventAnnotationsId;
+		}
 
-		// Convert time to server time
-		assert(root.get("client_ts", Json::nullValue).isInt());
-		root["client_ts"] = root.get("client_ts", 0).asInt64() + serverTimeDifference;
+		// Events of older versions have client_ts in their data, it is converted to server time while writing the json
+		writer.Clear();
+		writer.BeginObject();
+		writer.WriteMembers(annotations);
+		if (sqlite3_column_type(statement, 2) != SQLITE_NULL)
+			writer.WriteInt("client_ts", sqlite3_column_int64(statement, 2) + serverTimeDifference);
+		if (!EventEncoder::WriteJson(data, size, serverTimeDifference, writer))
+		{
+			assert(false);
+			continue;
+		}
+		writer.EndObject();
 
-		outJson.append(root);
+		outJson += outJson.empty() ? '[' : ',';
+		outJson += writer.GetBuffer();
 	}
 
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
-		return false;
+	if (!outJson.empty())
+		outJson += ']';
 
 	return true;
 }
 
-bool GameAnalyticsDatabase::DeleteFlaggedEvents(int requestId)
+bool GameAnalyticsDatabase::DeleteLeasedEvents(int requestId)
 {
-	std::string statementStr = "DELETE FROM `events` WHERE `is_sent` = ?;";
+	std::unordered_map<int, EventRange>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	// Events that were evicted from the batch are not counted anymore
+	long long numEvents = 0;
+	long long numBytes = 0;
+	if (HasEventQuota() && !GetEventRangeSize(it->second.firstEventId, it->second.lastEventId, numEvents, numBytes))
+		return false;
 
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
+	if (!BeginTransaction())
 		return false;
 
-	rc = sqlite3_bind_int(statement, 1, requestId);
-	assert(rc == SQLITE_OK);
+	bool isDeleted;
+	{
+		ScopedStatement statement(statements[Statement::DeleteEvents]);
 
-	rc = sqlite3_step(statement);
-	if (rc != SQLITE_DONE)
-		return false;
+		int rc = sqlite3_bind_int64(statement, 1, it->second.firstEventId);
+		assert(rc == SQLITE_OK);
+		rc = sqlite3_bind_int64(statement, 2, it->second.lastEventId);
+		assert(rc == SQLITE_OK);
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
+		isDeleted = (sqlite3_step(statement) == SQLITE_DONE);
+	}
+	isDeleted = isDeleted && DeleteBatch(it->second.firstEventId) && DeleteUnusedAnnotations();
+
+	if (!CommitTransaction() || !isDeleted)
 		return false;
 
+	numStoredEvents -= numEvents;
+	numStoredBytes -= numBytes;
+	leasedBatches.erase(it);
 	return true;
 }
 
-bool GameAnalyticsDatabase::GetProgressionAttempts(const char* progressionEventId, int& outAttempts)
+bool GameAnalyticsDatabase::GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference)
 {
-	std::string statementStr = "SELECT `attempt_num` FROM `progression` WHERE `progression_event_id` = ?;";
+	outHasPayload = false;
 
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	std::unordered_map<int, EventRange>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
 
-	rc = sqlite3_bind_text(statement, 1, progressionEventId, -1, NULL);
+	ScopedStatement statement(statements[Statement::GetBatchPayload]);
+
+	int rc = sqlite3_bind_int64(statement, 1, it->second.firstEventId);
 	assert(rc == SQLITE_OK);
 
 	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
 	{
-		assert(sqlite3_column_count(statement) == 1);
-		outAttempts = sqlite3_column_int(statement, 0);
+		assert(sqlite3_column_count(statement) == 3);
+		outHasPayload = true;
+		outPayload.assign((const char*)sqlite3_column_blob(statement, 0), sqlite3_column_bytes(statement, 0));
+		outHmac = (const char*)sqlite3_column_text(statement, 1);
+		outServerTimeDifference = sqlite3_column_int64(statement, 2);
 	}
 
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
-		return false;
-
 	return true;
 }
 
-bool GameAnalyticsDatabase::SetProgressionAttempts(const char* progressionEventId, int attempts)
+bool GameAnalyticsDatabase::SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference)
 {
-	std::string statementStr = "INSERT OR REPLACE INTO `progression` (`progression_event_id`, `attempt_num`) VALUES(?, ?);";
+	std::unordered_map<int, EventRange>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
 
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	assert(rc == SQLITE_OK);
+	ScopedStatement statement(statements[Statement::SetBatchPayload]);
 
-	rc = sqlite3_bind_text(statement, 1, progressionEventId, -1, NULL);
+	int rc = sqlite3_bind_blob(statement, 1, payload.data(), (int)payload.size(), NULL);
 	assert(rc == SQLITE_OK);
-	rc = sqlite3_bind_int(statement, 2, attempts);
+	rc = sqlite3_bind_text(statement, 2, hmac.c_str(), (int)hmac.length(), NULL);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 3, serverTimeDifference);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 4, it->second.firstEventId);
 	assert(rc == SQLITE_OK);
 
 	rc = sqlite3_step(statement);
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	return (rc == SQLITE_OK);
+	return true;
 }
 
-bool GameAnalyticsDatabase::DeleteProgressionAttempts(const char* progressionEventId)
+bool GameAnalyticsDatabase::ClearLeasedPayload(int requestId)
 {
-	std::string statementStr = "DELETE FROM `progression` WHERE `progression_event_id` = ?;";
-
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
+	std::unordered_map<int, EventRange>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
 		return false;
 
-	rc = sqlite3_bind_text(statement, 1, progressionEventId, -1, NULL);
+	ScopedStatement statement(statements[Statement::ClearBatchPayload]);
+
+	int rc = sqlite3_bind_int64(statement, 1, it->second.firstEventId);
 	assert(rc == SQLITE_OK);
 
 	rc = sqlite3_step(statement);
 	if (rc != SQLITE_DONE)
 		return false;
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
-		return false;
-
 	return true;
 }
 
-bool GameAnalyticsDatabase::UpdateSessionEnds(const Json::Value& eventData, const char* jsonString, long long sessionStartTimestamp)
+bool GameAnalyticsDatabase::AddLeasedAttempt(int requestId, int& outNumAttempts)
 {
-	assert(eventData.get("client_ts", Json::nullValue).isInt());
-	assert(eventData.get("session_id", Json::nullValue).isString());
+	std::unordered_map<int, EventRange>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
 
-	if (eventData.get("category", Json::nullValue).asString() == "session_end")
 	{
-		// This is a session_end, so remove from database
-		std::string statementStr = "DELETE FROM `session_end` WHERE `session_id` = ?;";
-
-		sqlite3_stmt* statement = NULL;
-		int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-		if (rc != SQLITE_OK)
-			return false;
+		ScopedStatement statement(statements[Statement::AddBatchAttempt]);
 
-		std::string sessionID = eventData.get("session_id", "").asString();
-		rc = sqlite3_bind_text(statement, 1, sessionID.c_str(), -1, NULL);
+		int rc = sqlite3_bind_int64(statement, 1, it->second.firstEventId);
 		assert(rc == SQLITE_OK);
 
 		rc = sqlite3_step(statement);
 		if (rc != SQLITE_DONE)
 			return false;
-
-		rc = sqlite3_finalize(statement);
-		return (rc == SQLITE_OK);
 	}
-	else
-	{
-		// Updates or creates a new session to end
-		std::string statementStr = "INSERT OR REPLACE INTO `session_end` (`session_start_ts`, `session_id`, `last_event_default_annotations`) VALUES(?, ?, ?);";
 
-		sqlite3_stmt* statement = NULL;
-		int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-		if (rc != SQLITE_OK)
-			return false;
+	ScopedStatement statement(statements[Statement::GetBatchAttempts]);
 
-		// If this is not cached it sends garbage for some reason..
-		// Maybe sqlite's defines do something funky
-		std::string sessionID = eventData.get("session_id", "").asString();
+	int rc = sqlite3_bind_int64(statement, 1, it->second.firstEventId);
+	assert(rc == SQLITE_OK);
 
-		rc = sqlite3_bind_int64(statement, 1, sessionStartTimestamp);
-		assert(rc == SQLITE_OK);
-		rc = sqlite3_bind_text(statement, 2, sessionID.c_str(), -1, NULL);
-		assert(rc == SQLITE_OK);
-		rc = sqlite3_bind_text(statement, 3, jsonString, -1, NULL);
-		assert(rc == SQLITE_OK);
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		assert(sqlite3_column_count(statement) == 1);
+		outNumAttempts = sqlite3_column_int(statement, 0);
+	}
 
-		rc = sqlite3_step(statement);
-		if (rc != SQLITE_DONE)
-			return false;
+	if (rc != SQLITE_DONE)
+		return false;
 
-		rc = sqlite3_finalize(statement);
-		return (rc == SQLITE_OK);
-	}
+	return true;
 }
 
-bool GameAnalyticsDatabase::CreateDatabaseTables()
+bool GameAnalyticsDatabase::CanReclaimFreePages() const
 {
-	std::string query = "";
-	query += "CREATE TABLE `events` (`json` TEXT NOT NULL, `is_sent` INTEGER NOT NULL DEFAULT 0);";
-	query += "CREATE TABLE `key_value` (`key` TEXT NOT NULL UNIQUE, `value` INTEGER, PRIMARY KEY(key));";
-	query += "CREATE TABLE `session_end` ( `session_start_ts` INTEGER NOT NULL, `session_id` TEXT NOT NULL UNIQUE, `last_event_default_annotations` TEXT NOT NULL, PRIMARY KEY(session_id));";
-	query += "CREATE TABLE `progression` (`progression_event_id` TEXT NOT NULL UNIQUE, `attempt_num` INTEGER NOT NULL DEFAULT 0, PRIMARY KEY(progression_event_id));";
-
-	char* errorMessage = NULL;
-	int success = sqlite3_exec(database, query.c_str(), NULL, NULL, &errorMessage);
-	if (success != SQLITE_OK)
-	{
-		OutputDebugStringA(errorMessage);
-		sqlite3_free(errorMessage);
-	}
-
-	return (success == SQLITE_OK);
+	return canReclaimFreePages;
 }
 
-bool GameAnalyticsDatabase::DoesKeyValueTableExist()
+bool GameAnalyticsDatabase::GetNumFreePages(int& outNumFreePages) const
 {
-	std::string query = "SELECT name FROM sqlite_master WHERE type='table' AND name='key_value';";
-
-	sqlite3_stmt* statement = NULL;
-	int rc = sqlite3_prepare_v2(database, query.c_str(), -1, &statement, NULL);
-	if (rc != SQLITE_OK)
-		return false;
+	ScopedStatement statement(statements[Statement::GetNumFreePages]);
+	int rc;
 
-	int foundRows = 0;
 	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
 	{
-		++foundRows;
+		assert(sqlite3_column_count(statement) == 1);
+		outNumFreePages = sqlite3_column_int(statement, 0);
 	}
-	if (rc != SQLITE_DONE)
-		return false;
 
-	rc = sqlite3_finalize(statement);
-	if (rc != SQLITE_OK)
+	if (rc != SQLITE_DONE)
 		return false;
 
-	return (foundRows > 0);
+	return true;
 }
 
-bool GameAnalyticsDatabase::DropAllTables()
+bool GameAnalyticsDatabase::ReclaimFreePages(int& outNumFreePages)
 {
-	for (size_t i = 0; i < tableStructures.size(); ++i)
+	assert(transactionDepth == 0); // Would only be reclaimed when the transaction is committed
+	assert(canReclaimFreePages); // Would not reclaim anything
+
 	{
-		std::string statementStr = "DROP TABLE IF EXISTS `" + std::string(tableStructures[i].tableName) + "`;";
+		ScopedStatement statement(statements[Statement::ReclaimFreePages]);
 
-		sqlite3_stmt* statement = NULL;
-		int rc = sqlite3_prepare_v2(database, statementStr.c_str(), -1, &statement, NULL);
-		if (rc != SQLITE_OK)
+		int rc;
+		while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
 		{
-			OutputDebugStringA(sqlite3_errmsg(database));
-			return false;
 		}
 
-		rc = sqlite3_step(statement);
 		if (rc != SQLITE_DONE)
 			return false;
+	}
+
+	return GetNumFreePages(outNumFreePages);
+}
+
+bool GameAnalyticsDatabase::GetAllProgressionAttempts(std::unordered_map<std::string, int>& outProgressionAttempts) const
+{
+	ScopedStatement statement(statements[Statement::GetAllProgressionAttempts]);
+	int rc;
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		assert(sqlite3_column_count(statement) == 2);
+		outProgressionAttempts[(const char*)sqlite3_column_text(statement, 0)] = sqlite3_column_int(statement, 1);
+	}
+
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::SetProgressionAttempts(const char* progressionEventId, int attempts)
+{
+	ScopedStatement statement(statements[Statement::SetProgressionAttempts]);
+
+	int rc = sqlite3_bind_text(statement, 1, progressionEventId, -1, NULL);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int(statement, 2, attempts);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::DeleteProgressionAttempts(const char* progressionEventId)
+{
+	ScopedStatement statement(statements[Statement::DeleteProgressionAttempts]);
+
+	int rc = sqlite3_bind_text(statement, 1, progressionEventId, -1, NULL);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::SetSessionEnd(const char* sessionId, long long sessionStartTimestamp, long long lastEventTimestamp, const char* defaultAnnotations)
+{
+	ScopedStatement statement(statements[Statement::SetSessionEnd]);
+
+	int rc = sqlite3_bind_int64(statement, 1, sessionStartTimestamp);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_text(statement, 2, sessionId, -1, NULL);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 3, lastEventTimestamp);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_text(statement, 4, defaultAnnotations, -1, NULL);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::DeleteSessionEnd(const char* sessionId)
+{
+	ScopedStatement statement(statements[Statement::DeleteSessionEnd]);
+
+	int rc = sqlite3_bind_text(statement, 1, sessionId, -1, NULL);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+void GameAnalyticsDatabase::ApplyDurabilityProfile(DurabilityProfile::Enum durabilityProfile)
+{
+	// Page size only changes a new database and has to be set before switching to WAL.
+	// WAL only syncs on checkpoints when synchronous is NORMAL, and never gets corrupted by it.
+	std::string query = "PRAGMA page_size = 4096;";
+	query += "PRAGMA journal_mode = WAL;";
+
+	switch (durabilityProfile)
+	{
+	case DurabilityProfile::Paranoid:
+		query += "PRAGMA synchronous = FULL;";
+		query += "PRAGMA mmap_size = 0;";
+		query += "PRAGMA cache_size = -512;"; // In KiB
+		break;
+
+	case DurabilityProfile::Balanced:
+		query += "PRAGMA synchronous = NORMAL;";
+		query += "PRAGMA mmap_size = 16777216;";
+		query += "PRAGMA cache_size = -2048;";
+		break;
+
+	case DurabilityProfile::Fast:
+		query += "PRAGMA synchronous = OFF;";
+		query += "PRAGMA mmap_size = 67108864;";
+		query += "PRAGMA cache_size = -8192;";
+		break;
+
+	default:
+		assert(false);
+		break;
+	}
+
+	// Not being able to change these settings doesn't stop the database from working, eg. WAL isn't supported on network drives
+	char* errorMessage = NULL;
+	int rc = sqlite3_exec(database, query.c_str(), NULL, NULL, &errorMessage);
+	if (rc != SQLITE_OK)
+	{
+		OutputDebugStringA(errorMessage);
+		sqlite3_free(errorMessage);
+	}
+}
+
+bool GameAnalyticsDatabase::EnableIncrementalVacuum()
+{
+	if (IsIncrementalVacuumEnabled())
+		return true;
+
+	// Databases of older versions have to be rebuilt once to switch, which blocks Init() longer the more events are stored.
+	// So only switch while few pages are in use. A larger database only switches on a later Init() that finds it small,
+	// which doesn't happen while a backlog stays stored. Without it the free pages are still reused, the file just doesn't shrink.
+	int numPages = 0;
+	int numFreePages = 0;
+	if (!GetPragmaValue("PRAGMA page_count;", numPages) || !GetPragmaValue("PRAGMA freelist_count;", numFreePages) || numPages - numFreePages > MaxPagesToRebuild)
+		return false;
+
+	char* errorMessage = NULL;
+	int rc = sqlite3_exec(database, "PRAGMA auto_vacuum = INCREMENTAL; VACUUM;", NULL, NULL, &errorMessage);
+	if (rc != SQLITE_OK)
+	{
+		OutputDebugStringA(errorMessage);
+		sqlite3_free(errorMessage);
+	}
+
+	// The vacuum fails when the database is busy or the disk is full, the mode only changes when it succeeded
+	return IsIncrementalVacuumEnabled();
+}
 
-		rc = sqlite3_finalize(statement);
+bool GameAnalyticsDatabase::IsIncrementalVacuumEnabled() const
+{
+	const int IncrementalAutoVacuum = 2;
+	int autoVacuum = 0;
+	return GetPragmaValue("PRAGMA auto_vacuum;", autoVacuum) && autoVacuum == IncrementalAutoVacuum;
+}
+
+// Only used before the statements are prepared
+bool GameAnalyticsDatabase::GetPragmaValue(const char* query, int& outValue) const
+{
+	sqlite3_stmt* statement = NULL;
+	int rc = sqlite3_prepare_v2(database, query, -1, &statement, NULL);
+	if (rc != SQLITE_OK)
+		return false;
+
+	const bool hasValue = (sqlite3_step(statement) == SQLITE_ROW);
+	if (hasValue)
+		outValue = sqlite3_column_int(statement, 0);
+	sqlite3_finalize(statement);
+	return hasValue;
+}
+
+bool GameAnalyticsDatabase::PrepareStatements()
+{
+	for (int i = 0; i < Statement::Count; ++i)
+	{
+		assert(statements[i] == NULL);
+		int rc = sqlite3_prepare_v2(database, statementQueries[i], -1, &statements[i], NULL);
 		if (rc != SQLITE_OK)
+		{
+			OutputDebugStringA(sqlite3_errmsg(database));
 			return false;
+		}
 	}
 	return true;
 }
 
-bool GameAnalyticsDatabase::ValidateTableStructures()
+void GameAnalyticsDatabase::FinalizeStatements()
 {
-	for (size_t i = 0; i < tableStructures.size(); ++i)
+	for (int i = 0; i < Statement::Count; ++i)
+	{
+		sqlite3_finalize(statements[i]);
+		statements[i] = NULL;
+	}
+}
+
+bool GameAnalyticsDatabase::LoadBatches()
+{
+	leasedBatches.clear();
+	releasedBatches.clear();
+	lastLeasedEventId = 0;
+
+	// None of the stored batches were deleted before the restart, so all of them are sent again
+	ScopedStatement statement(statements[Statement::GetAllBatches]);
+	int rc;
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		assert(sqlite3_column_count(statement) == 2);
+
+		EventRange range;
+		range.firstEventId = sqlite3_column_int64(statement, 0);
+		range.lastEventId = sqlite3_column_int64(statement, 1);
+		releasedBatches[range.firstEventId] = range;
+
+		if (range.lastEventId > lastLeasedEventId)
+			lastLeasedEventId = range.lastEventId;
+	}
+
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::SetBatch(const EventRange& range)
+{
+	ScopedStatement statement(statements[Statement::SetBatch]);
+
+	int rc = sqlite3_bind_int64(statement, 1, range.firstEventId);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 2, range.lastEventId);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::DeleteBatch(long long firstEventId)
+{
+	ScopedStatement statement(statements[Statement::DeleteBatch]);
+
+	int rc = sqlite3_bind_int64(statement, 1, firstEventId);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::GetEventRange(long long afterEventId, long long lastEventId, int amount, int& outNumEvents, EventRange& outRange) const
+{
+	ScopedStatement statement(statements[Statement::GetEventRange]);
+
+	int rc = sqlite3_bind_int64(statement, 1, afterEventId);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 2, lastEventId);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int(statement, 3, amount);
+	assert(rc == SQLITE_OK);
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
 	{
-		if (!ValidateTableStructure(tableStructures[i].tableName, tableStructures[i].columns))
+		assert(sqlite3_column_count(statement) == 3);
+		outNumEvents = sqlite3_column_int(statement, 0);
+		outRange.firstEventId = sqlite3_column_int64(statement, 1);
+		outRange.lastEventId = sqlite3_column_int64(statement, 2);
+	}
+
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::GetEventRangeSize(long long firstEventId, long long lastEventId, long long& outNumEvents, long long& outNumBytes) const
+{
+	ScopedStatement statement(statements[Statement::GetEventRangeSize]);
+
+	int rc = sqlite3_bind_int64(statement, 1, firstEventId);
+	assert(rc == SQLITE_OK);
+	rc = sqlite3_bind_int64(statement, 2, lastEventId);
+	assert(rc == SQLITE_OK);
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		assert(sqlite3_column_count(statement) == 2);
+		outNumEvents = sqlite3_column_int64(statement, 0);
+		outNumBytes = (long long)sqlite3_column_double(statement, 1);
+	}
+
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::HasEventQuota() const
+{
+	return (maxStoredEvents > 0 || maxStoredBytes > 0);
+}
+
+bool GameAnalyticsDatabase::IsEventInBatch(long long eventId) const
+{
+	if (eventId <= lastLeasedEventId)
+	{
+		for (std::unordered_map<int, EventRange>::const_iterator it = leasedBatches.begin(); it != leasedBatches.end(); ++it)
+		{
+			if (eventId >= it->second.firstEventId && eventId <= it->second.lastEventId)
+				return true;
+		}
+	}
+
+	// The batch with the last first event id before this event is the only one that can contain it
+	std::map<long long, EventRange>::const_iterator released = releasedBatches.upper_bound(eventId);
+	if (released == releasedBatches.begin())
+		return false;
+
+	--released;
+	return (eventId <= released->second.lastEventId);
+}
+
+bool GameAnalyticsDatabase::EvictEvents()
+{
+	// Evict a sixteenth of the quota more than needed, so this doesn't run again for every new event
+	const long long targetEvents = maxStoredEvents - maxStoredEvents / 16;
+	const long long targetBytes = maxStoredBytes - maxStoredBytes / 16;
+
+	std::vector<long long> evictedIds;
+	long long numEvents = numStoredEvents;
+	long long numBytes = numStoredBytes;
+	long long lastSeenEventId = lastUnevictableEventId;
+	bool isOverQuota = true;
+
+	// Oldest first looks at all evictable priorities at once, lowest priority first looks at one priority at a time
+	const bool isByPriority = (evictionPolicy == EvictionPolicy::LowestPriorityFirst);
+	for (int priority = 0; isOverQuota && priority <= maxEvictedPriority; ++priority)
+	{
+		ScopedStatement statement(statements[isByPriority ? Statement::GetEvictableEventsOfPriority : Statement::GetEvictableEvents]);
+
+		int rc;
+		if (isByPriority)
+		{
+			rc = sqlite3_bind_int(statement, 1, priority);
+			assert(rc == SQLITE_OK);
+			rc = sqlite3_bind_int64(statement, 2, lastUnevictableEventId);
+			assert(rc == SQLITE_OK);
+		}
+		else
+		{
+			rc = sqlite3_bind_int64(statement, 1, lastUnevictableEventId);
+			assert(rc == SQLITE_OK);
+			rc = sqlite3_bind_int(statement, 2, maxEvictedPriority);
+			assert(rc == SQLITE_OK);
+		}
+
+		while (isOverQuota && (rc = sqlite3_step(statement)) == SQLITE_ROW)
+		{
+			assert(sqlite3_column_count(statement) == 2);
+			const long long eventId = sqlite3_column_int64(statement, 0);
+			lastSeenEventId = std::max(lastSeenEventId, eventId);
+			if (IsEventInBatch(eventId))
+				continue;
+
+			evictedIds.push_back(eventId);
+			--numEvents;
+			numBytes -= sqlite3_column_int64(statement, 1);
+			isOverQuota = (maxStoredEvents > 0 && numEvents > targetEvents) || (maxStoredBytes > 0 && numBytes > targetBytes);
+		}
+
+		if (rc != SQLITE_ROW && rc != SQLITE_DONE)
 			return false;
+
+		if (!isByPriority)
+			break;
+	}
+
+	// When the quota is still exceeded all evictable events were found, the ones that are left are in a batch or have a higher
+	// priority. They stay that way until they are deleted, so they are skipped from now on. The database grows past the quota
+	// while only those events are stored.
+	const long long lastCheckedEventId = isOverQuota ? std::max(lastAddedEventId, lastSeenEventId) : lastUnevictableEventId;
+
+	if (evictedIds.empty())
+	{
+		lastUnevictableEventId = lastCheckedEventId;
+		return true;
+	}
+
+	if (!BeginTransaction())
+		return false;
+
+	bool isEvicted = true;
+	for (std::vector<long long>::const_iterator it = evictedIds.begin(); isEvicted && it != evictedIds.end(); ++it)
+	{
+		ScopedStatement statement(statements[Statement::DeleteEvent]);
+
+		int rc = sqlite3_bind_int64(statement, 1, *it);
+		assert(rc == SQLITE_OK);
+
+		isEvicted = (sqlite3_step(statement) == SQLITE_DONE);
+	}
+	isEvicted = isEvicted && DeleteUnusedAnnotations();
+
+	if (!CommitTransaction() || !isEvicted)
+		return false;
+
+	numStoredEvents = numEvents;
+	numStoredBytes = numBytes;
+	numEvictedEvents += (unsigned int)evictedIds.size();
+	lastUnevictableEventId = lastCheckedEventId;
+	return true;
+}
+
+bool GameAnalyticsDatabase::AddAnnotations(const std::string& defaultAnnotations)
+{
+	ScopedStatement statement(statements[Statement::AddAnnotations]);
+
+	int rc = sqlite3_bind_text(statement, 1, defaultAnnotations.c_str(), (int)defaultAnnotations.length(), NULL);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	lastAnnotations = defaultAnnotations;
+	lastAnnotationsId = sqlite3_last_insert_rowid(database);
+	return true;
+}
+
+bool GameAnalyticsDatabase::GetAnnotations(long long annotationsId, std::string& outDefaultAnnotations) const
+{
+	ScopedStatement statement(statements[Statement::GetAnnotations]);
+
+	int rc = sqlite3_bind_int64(statement, 1, annotationsId);
+	assert(rc == SQLITE_OK);
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		assert(sqlite3_column_count(statement) == 1);
+		outDefaultAnnotations = (const char*)sqlite3_column_text(statement, 0);
 	}
 
+	if (rc != SQLITE_DONE)
+		return false;
+
 	return true;
 }
 
+bool GameAnalyticsDatabase::DeleteUnusedAnnotations()
+{
+	ScopedStatement statement(statements[Statement::DeleteUnusedAnnotations]);
+
+	// Without events nothing is used, unless annotations were added since Initialize()
+	int rc = sqlite3_bind_int64(statement, 1, (lastAnnotationsId != 0) ? lastAnnotationsId : LLONG_MAX);
+	assert(rc == SQLITE_OK);
+
+	rc = sqlite3_step(statement);
+	if (rc != SQLITE_DONE)
+		return false;
+
+	return true;
+}
+
+bool GameAnalyticsDatabase::DoesTableExist(const char* tableName)
+{
+	std::string query = "SELECT name FROM sqlite_master WHERE type='table' AND name=?;";
+
+	sqlite3_stmt* statement = NULL;
+	int rc = sqlite3_prepare_v2(database, query.c_str(), -1, &statement, NULL);
+	if (rc != SQLITE_OK)
+		return false;
+
+	rc = sqlite3_bind_text(statement, 1, tableName, -1, NULL);
+	assert(rc == SQLITE_OK);
+
+	int foundRows = 0;
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		++foundRows;
+	}
+	if (rc != SQLITE_DONE)
+		return false;
+
+	rc = sqlite3_finalize(statement);
+	if (rc != SQLITE_OK)
+		return false;
+
+	return (foundRows > 0);
+}
+
+bool GameAnalyticsDatabase::GetSchemaVersion(int& outVersion)
+{
+	sqlite3_stmt* statement = NULL;
+	int rc = sqlite3_prepare_v2(database, "PRAGMA user_version;", -1, &statement, NULL);
+	if (rc != SQLITE_OK)
+		return false;
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		outVersion = sqlite3_column_int(statement, 0);
+	}
+	if (rc != SQLITE_DONE)
+		return false;
+
+	rc = sqlite3_finalize(statement);
+	return (rc == SQLITE_OK);
+}
+
+bool GameAnalyticsDatabase::SetSchemaVersion(int version)
+{
+	// Pragmas can't be bound
+	std::string query = "PRAGMA user_version = " + std::to_string(version) + ";";
+
+	char* errorMessage = NULL;
+	int rc = sqlite3_exec(database, query.c_str(), NULL, NULL, &errorMessage);
+	if (rc != SQLITE_OK)
+	{
+		OutputDebugStringA(errorMessage);
+		sqlite3_free(errorMessage);
+	}
+
+	return (rc == SQLITE_OK);
+}
+
+bool GameAnalyticsDatabase::MigrateBaselineDatabase()
+{
+	std::string query = "BEGIN TRANSACTION;";
+
+	if (DoesTableExist("events") && !ValidateTableStructure("events", FindTableDescription("events")->columns))
+	{
+		// The first versions stored the json of the events with a flag for the ones that were being sent. All events
+		// are sent again in the order in which they were added, so they keep their rowid and the flag is dropped.
+		// They stay json, which is marked by not having annotations.
+		query += "ALTER TABLE `events` RENAME TO `events_old`;";
+		query += FindTableDescription("events")->createStatement;
+		query += "INSERT INTO `events` (`id`, `annotations_id`, `data`) SELECT `_rowid_`, 0, CAST(`json` AS BLOB) FROM `events_old` ORDER BY `_rowid_`;";
+		query += "DROP TABLE `events_old`;";
+	}
+
+	if (DoesTableExist("session_end") && !ValidateTableStructure("session_end", FindTableDescription("session_end")->columns))
+	{
+		// The first versions stored the json of the last event of a session, the sessions that weren't ended are kept
+		std::vector<SessionEndData> sessionEnds;
+		if (GetJsonSessionEnds(sessionEnds))
+		{
+			query += "DROP TABLE `session_end`;";
+			query += FindTableDescription("session_end")->createStatement;
+			for (std::vector<SessionEndData>::const_iterator it = sessionEnds.begin(); it != sessionEnds.end(); ++it)
+			{
+				char* insert = sqlite3_mprintf("INSERT INTO `session_end` (`session_start_ts`, `session_id`, `last_event_ts`, `default_annotations`) VALUES(%lld, %Q, %lld, %Q);",
+					it->sessionStartTimestamp, it->sessionId.c_str(), it->lastEventTimestamp, it->defaultAnnotations.c_str());
+				query += insert;
+				sqlite3_free(insert);
+			}
+		}
+	}
+
+	query += "COMMIT TRANSACTION;";
+
+	char* errorMessage = NULL;
+	int rc = sqlite3_exec(database, query.c_str(), NULL, NULL, &errorMessage);
+	if (rc != SQLITE_OK)
+	{
+		// The tables that couldn't be migrated are recreated
+		OutputDebugStringA(errorMessage);
+		sqlite3_free(errorMessage);
+		sqlite3_exec(database, "ROLLBACK TRANSACTION;", NULL, NULL, NULL);
+	}
+
+	return (rc == SQLITE_OK);
+}
+
+bool GameAnalyticsDatabase::GetJsonSessionEnds(std::vector<SessionEndData>& outSessionEndData) const
+{
+	// Only the default annotations of the last event are kept, in the order in which they are written now
+	static const char* const annotationKeys[] = { "device", "v", "user_id", "sdk_version", "os_version", "manufacturer", "platform", "session_id", "session_num", "build", "progression" };
+
+	sqlite3_stmt* statement = NULL;
+	int rc = sqlite3_prepare_v2(database, "SELECT `session_start_ts`, `session_id`, `last_event_default_annotations` FROM `session_end`;", -1, &statement, NULL);
+	if (rc != SQLITE_OK)
+		return false;
+
+	while ((rc = sqlite3_step(statement)) == SQLITE_ROW)
+	{
+		SessionEndData session;
+		session.sessionStartTimestamp = sqlite3_column_int64(statement, 0);
+		session.sessionId = (const char*)sqlite3_column_text(statement, 1);
+
+		Json::Reader reader;
+		Json::Value lastEvent;
+		if (!reader.parse((const char*)sqlite3_column_text(statement, 2), lastEvent, false) || !lastEvent.isObject())
+			continue; // Can't be ended without its annotations
+
+		session.lastEventTimestamp = lastEvent.get("client_ts", session.sessionStartTimestamp).asInt64();
+
+		EventWriter writer;
+		writer.BeginObject();
+		for (size_t i = 0; i < sizeof(annotationKeys) / sizeof(annotationKeys[0]); ++i)
+		{
+			const Json::Value& value = lastEvent[annotationKeys[i]];
+			if (value.isString())
+				writer.WriteString(annotationKeys[i], value.asString());
+			else if (value.isIntegral())
+				writer.WriteInt(annotationKeys[i], value.asInt64());
+		}
+		writer.EndObject();
+
+		session.defaultAnnotations = writer.GetMembers();
+		outSessionEndData.push_back(session);
+	}
+
+	sqlite3_finalize(statement);
+	return (rc == SQLITE_DONE);
+}
+
+const GameAnalyticsDatabase::TableDescription* GameAnalyticsDatabase::FindTableDescription(const char* tableName) const
+{
+	for (size_t i = 0; i < tableStructures.size(); ++i)
+	{
+		if (strcmp(tableStructures[i].tableName, tableName) == 0)
+			return &tableStructures[i];
+	}
+
+	assert(false);
+	return NULL;
+}
+
+bool GameAnalyticsDatabase::RecreateTable(const TableDescription& table)
+{
+	std::string query = "DROP TABLE IF EXISTS `" + std::string(table.tableName) + "`;";
+	query += table.createStatement;
+
+	char* errorMessage = NULL;
+	int success = sqlite3_exec(database, query.c_str(), NULL, NULL, &errorMessage);
+	if (success != SQLITE_OK)
+	{
+		OutputDebugStringA(errorMessage);
+		sqlite3_free(errorMessage);
+	}
+
+	return (success == SQLITE_OK);
+}
+
 bool GameAnalyticsDatabase::ValidateTableStructure(const char* tableName, const std::vector<ColumnDescription>& tableStructure)
 {
 	std::string query = "PRAGMA `table_info`(`" + std::string(tableName) + "`);";
@@ -596,4 +1499,4 @@ bool GameAnalyticsDatabase::ValidateTableStructure(const char* tableName, const
 		return false;
 
 	return !failedCheck && foundRows;
-}
+}
\ No newline at end of file
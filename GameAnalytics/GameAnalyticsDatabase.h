@@ -1,54 +1,109 @@
 #pragma once
 
+#include <atomic>
 #include <string>
 #include <vector>
+#include <map>
+#include <unordered_map>
 
 #include "GameAnalyticsResult.h"
-
-namespace Json
-{
-	class Value;
-};
+#include "IEventStore.h"
 
 struct sqlite3;
+struct sqlite3_stmt;
 
 namespace Analytics
 {
-	class GameAnalyticsDatabase
+	// How the event database trades safety against write speed. Events that are not committed yet are lost
+	// in every profile, see InitData::maxCommitLatency.
+	struct DurabilityProfile
+	{
+		enum Enum
+		{
+			Paranoid,	// Every commit is on disk before it returns. Nothing that was committed is lost, not even on power loss.
+			Balanced,	// Committed events survive a crash of the game. Power loss can undo the last commits, but doesn't corrupt the database.
+			Fast,		// Committed events survive a crash of the game. Power loss can corrupt the database, which is recreated on the next Init().
+		};
+	};
+
+	// Which events are evicted first when more events are stored than the quota allows, see SetEventQuota()
+	struct EvictionPolicy
+	{
+		enum Enum
+		{
+			OldestFirst,			// The oldest events, whatever their priority
+			LowestPriorityFirst,	// The oldest events of the lowest priority, then the oldest of the next priority and so on
+		};
+	};
+
+	class GameAnalyticsDatabase : public IEventStore
 	{
 	public:
 		struct SessionEndData
 		{
 			long long sessionStartTimestamp;
+			long long lastEventTimestamp;
 			std::string sessionId;
-			std::string annotations;
+			std::string defaultAnnotations; // Json members without the surrounding braces
 		};
 
 		GameAnalyticsDatabase();
 		~GameAnalyticsDatabase();
 
-		Result::Enum Initialize(const char* databaseFile);
+		Result::Enum Initialize(const char* databaseFile, DurabilityProfile::Enum durabilityProfile);
 		bool IsInitialized() const;
 
+		// Also deletes the write-ahead log, which doesn't belong to a new database with the same name
+		static void DeleteDatabaseFiles(const char* databaseFile);
+
 	public:
 		int GetNumSessions() const;
 		void SetNumSessions(int sessions);
 		bool SetKeyValuePair(const char* key, int value);
 		bool GetKeyValuePair(const char* key, int& outValue) const;
 
-		bool AddEvent(const char* eventData);
-
-		bool FlagEvents(int requestId, int amount);
-		bool UnflagEvents(int requestId);
-		bool UnflagAllEvents();
-		bool RetrieveFlaggedEvents(int requestId, Json::Value& outJson, long long serverTimeDifference) const;
-		bool DeleteFlaggedEvents(int requestId);
-
-		bool GetProgressionAttempts(const char* progressionEventId, int& outAttempts);
+		// Default annotations are only stored again when they are different from the ones of the previous event
+		bool AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int priority) override;
+
+		// Evicts events when more than maxEvents are stored, or when their data takes more than maxBytes. 0 means no limit.
+		// Events are only counted while there is a quota, setting it counts the stored events once. Events in a batch and
+		// events with a priority above maxEvictedPriority are never evicted, so the quota is exceeded while only those are stored.
+		// LowestPriorityFirst adds an index on the priority, which is dropped again for the other policies.
+		bool SetEventQuota(long long maxEvents, long long maxBytes, EvictionPolicy::Enum policy, int maxEvictedPriority);
+		unsigned int GetNumEvictedEvents() const; // Since Initialize(), the count isn't stored. Can be called from any thread.
+
+		// Transactions can be nested, only the outermost commit writes to disk
+		bool BeginTransaction() override;
+		bool CommitTransaction() override;
+
+		// Every request leases a range of event ids, which is stored in the batches table until the events are
+		// deleted. Released batches and batches that were leased before a restart are sent again before new events.
+		bool LeaseEvents(int requestId, int amount) override;
+		bool HasLeasedEvents(int requestId) const override;
+		bool ReleaseEvents(int requestId) override;
+		bool DeleteLeasedEvents(int requestId) override;
+		bool RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference) override;
+		bool ClearLeasedPayload(int requestId) override;
+
+		// Payloads are stored in the batches table, splitting a batch clears its payload
+		bool GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference) override;
+		bool SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference) override;
+		bool AddLeasedAttempt(int requestId, int& outNumAttempts) override;
+
+		// Deleted events leave free pages behind, they are only given back to the file system by ReclaimFreePages().
+		// Every call reclaims a few pages, so it can be called in between other work until no free pages are left.
+		// Only possible when incremental vacuum could be enabled by Initialize(), otherwise the pages are only reused.
+		bool CanReclaimFreePages() const;
+		bool GetNumFreePages(int& outNumFreePages) const;
+		bool ReclaimFreePages(int& outNumFreePages);
+
+		bool GetAllProgressionAttempts(std::unordered_map<std::string, int>& outProgressionAttempts) const;
 		bool SetProgressionAttempts(const char* progressionEventId, int attempts);
 		bool DeleteProgressionAttempts(const char* progressionEventId);
 
-		bool UpdateSessionEnds(const Json::Value& eventData, const char* jsonString, long long sessionStartTimestamp);
+		// Sessions that are stored here were not ended yet
+		bool SetSessionEnd(const char* sessionId, long long sessionStartTimestamp, long long lastEventTimestamp, const char* defaultAnnotations);
+		bool DeleteSessionEnd(const char* sessionId);
 		bool GetAllSessionEnds(std::vector<SessionEndData>& outSessionEndData) const;
 
 	private:
@@ -70,18 +125,120 @@ namespace Analytics
 		{
 			std::vector<ColumnDescription> columns;
 			const char* tableName;
+			const char* createStatement;
+		};
+
+		// Both ids are inclusive, the first id is the key of the batch
+		struct EventRange
+		{
+			long long firstEventId;
+			long long lastEventId;
 		};
 
-		bool CreateDatabaseTables();
-		bool DoesKeyValueTableExist();
-		bool DropAllTables();
-		bool ValidateTableStructures();
+		void ApplyDurabilityProfile(DurabilityProfile::Enum durabilityProfile);
+		bool EnableIncrementalVacuum();
+		bool IsIncrementalVacuumEnabled() const;
+		bool GetPragmaValue(const char* query, int& outValue) const;
+		bool PrepareStatements();
+		void FinalizeStatements();
+		bool DoesTableExist(const char* tableName);
+		bool GetSchemaVersion(int& outVersion);
+		bool SetSchemaVersion(int version);
+		bool MigrateBaselineDatabase();
+		bool GetJsonSessionEnds(std::vector<SessionEndData>& outSessionEndData) const; // Of the session_end table of the baseline
+		const TableDescription* FindTableDescription(const char* tableName) const;
+		bool RecreateTable(const TableDescription& table);
 		bool ValidateTableStructure(const char* tableName, const std::vector<ColumnDescription>& tableStructure);
 
+		bool LoadBatches();
+		bool SetBatch(const EventRange& range);
+		bool DeleteBatch(long long firstEventId);
+		bool GetEventRange(long long afterEventId, long long lastEventId, int amount, int& outNumEvents, EventRange& outRange) const;
+		bool GetEventRangeSize(long long firstEventId, long long lastEventId, long long& outNumEvents, long long& outNumBytes) const;
+
+		bool HasEventQuota() const;
+		bool IsEventInBatch(long long eventId) const;
+		bool EvictEvents();
+
+		bool AddAnnotations(const std::string& defaultAnnotations);
+		bool GetAnnotations(long long annotationsId, std::string& outDefaultAnnotations) const;
+		bool DeleteUnusedAnnotations();
+
 	private:
+		// Stored as the user_version of the database, the databases of the first versions are still at 0
+		static const int SchemaVersion = 1;
+
+		// Rebuilding a database to switch to incremental vacuum takes longer the more pages are in use, larger databases aren't switched
+		static const int MaxPagesToRebuild = 256;
+
 		std::vector<TableDescription> tableStructures;
 
+	private:
+		// Every statement is prepared once by Initialize() and reset after each use
+		struct Statement
+		{
+			enum Enum
+			{
+				GetKeyValuePair,
+				SetKeyValuePair,
+				AddEvent,
+				BeginTransaction,
+				CommitTransaction,
+				GetEventRange,
+				RetrieveEvents,
+				DeleteEvents,
+				GetEventRangeSize,
+				GetEvictableEvents,
+				GetEvictableEventsOfPriority,
+				DeleteEvent,
+				GetNumFreePages,
+				ReclaimFreePages,
+				AddAnnotations,
+				GetAnnotations,
+				DeleteUnusedAnnotations,
+				GetAllBatches,
+				SetBatch,
+				GetBatchPayload,
+				SetBatchPayload,
+				ClearBatchPayload,
+				AddBatchAttempt,
+				GetBatchAttempts,
+				DeleteBatch,
+				GetAllProgressionAttempts,
+				SetProgressionAttempts,
+				DeleteProgressionAttempts,
+				GetAllSessionEnds,
+				SetSessionEnd,
+				DeleteSessionEnd,
+
+				Count
+			};
+		};
+
+		static const char* const statementQueries[Statement::Count];
+
 	private:
 		sqlite3* database;
+		sqlite3_stmt* statements[Statement::Count];
+		int transactionDepth;
+
+		std::unordered_map<int, EventRange> leasedBatches; // By request id
+		std::map<long long, EventRange> releasedBatches; // By first event id, so the oldest is sent first
+		long long lastLeasedEventId; // Events after this one are not in a batch yet
+
+		long long maxStoredEvents;
+		long long maxStoredBytes;
+		EvictionPolicy::Enum evictionPolicy;
+		int maxEvictedPriority;
+		long long numStoredEvents; // Only counted while there is a quota
+		long long numStoredBytes;
+		std::atomic<unsigned int> numEvictedEvents;
+		long long lastAddedEventId; // Since Initialize()
+		long long lastUnevictableEventId; // All stored events up to this one are in a batch or have a priority above maxEvictedPriority
+		bool canReclaimFreePages;
+
+		// Annotations are only added when they change, so their ids go up with the ids of the events
+		std::string lastAnnotations;
+		long long lastAnnotationsId;
 	};
 }
\ No newline at end of file
@@ -0,0 +1,321 @@
+#include "HybridEventStore.h"
+
+#include "EventEncoder.h"
+#include "EventWriter.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <iterator>
+
+using namespace Analytics;
+
+HybridEventStore::HybridEventStore() :
+	persistentStore(NULL),
+	spillThreshold(0),
+	isConnected(false),
+	hasPersistentEvents(true),
+	numReleasedEvents(0),
+	nextSequence(0)
+{
+}
+
+void HybridEventStore::Initialize(IEventStore* persistentStore, size_t spillThreshold)
+{
+	assert(!IsInitialized()); // Already initialized!
+	assert(persistentStore != NULL);
+
+	this->persistentStore = persistentStore;
+	this->spillThreshold = spillThreshold;
+}
+
+bool HybridEventStore::IsInitialized() const
+{
+	return persistentStore != NULL;
+}
+
+bool HybridEventStore::SetConnected(bool isConnected)
+{
+	this->isConnected = isConnected;
+	if (isConnected || !IsInitialized())
+		return true;
+
+	// Batches that are being sent are spilled when their request fails
+	return SpillEvents();
+}
+
+bool HybridEventStore::Spill()
+{
+	if (!IsInitialized())
+		return true;
+
+	// The batches of the persistent store are sent again on the next start with the payload they were sent with
+	persistentRequests.clear();
+	leasedBatches.clear();
+	return SpillEvents();
+}
+
+bool HybridEventStore::AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int priority)
+{
+	if (!IsInitialized())
+		return false;
+
+	if (!isConnected)
+	{
+		hasPersistentEvents = true;
+		return persistentStore->AddEvent(defaultAnnotations, clientTimestamp, encodedEvent, priority);
+	}
+
+	if (!lastAnnotations || *lastAnnotations != defaultAnnotations)
+		lastAnnotations = std::make_shared<const std::string>(defaultAnnotations);
+
+	MemoryEvent event;
+	event.sequence = nextSequence++;
+	event.defaultAnnotations = lastAnnotations;
+	event.clientTimestamp = clientTimestamp;
+	event.encodedEvent = encodedEvent;
+	event.priority = priority;
+	events.push_back(std::move(event));
+
+	// Sending doesn't keep up
+	if (events.size() + numReleasedEvents > spillThreshold)
+		return SpillEvents();
+
+	return true;
+}
+
+bool HybridEventStore::BeginTransaction()
+{
+	return IsInitialized() && persistentStore->BeginTransaction();
+}
+
+bool HybridEventStore::CommitTransaction()
+{
+	return IsInitialized() && persistentStore->CommitTransaction();
+}
+
+bool HybridEventStore::LeaseEvents(int requestId, int amount)
+{
+	if (!IsInitialized())
+		return false;
+
+	assert(amount > 0);
+	assert(leasedBatches.find(requestId) == leasedBatches.end());
+
+	// Spilled events are older than the ones in memory
+	if (hasPersistentEvents)
+	{
+		if (!persistentStore->LeaseEvents(requestId, amount))
+			return false;
+
+		if (persistentStore->HasLeasedEvents(requestId))
+		{
+			persistentRequests.insert(requestId);
+			return true;
+		}
+
+		hasPersistentEvents = false;
+	}
+
+	// Released batches go first, they are split when less events fit in a request than before
+	if (!releasedBatches.empty())
+	{
+		std::map<unsigned long long, Batch>::iterator it = releasedBatches.begin();
+		Batch& released = it->second;
+		if (released.events.size() <= (size_t)amount)
+		{
+			numReleasedEvents -= released.events.size();
+			leasedBatches[requestId] = std::move(released);
+			releasedBatches.erase(it);
+			return true;
+		}
+
+		Batch& leased = leasedBatches[requestId];
+		leased.events.assign(std::make_move_iterator(released.events.begin()), std::make_move_iterator(released.events.begin() + amount));
+		numReleasedEvents -= leased.events.size();
+
+		Batch remainder;
+		remainder.events.assign(std::make_move_iterator(released.events.begin() + amount), std::make_move_iterator(released.events.end()));
+		releasedBatches.erase(it);
+		releasedBatches[remainder.events.front().sequence] = std::move(remainder);
+		return true;
+	}
+
+	if (events.empty())
+		return true; // Nothing to send
+
+	const size_t numEvents = std::min(events.size(), (size_t)amount);
+	Batch& batch = leasedBatches[requestId];
+	batch.events.assign(std::make_move_iterator(events.begin()), std::make_move_iterator(events.begin() + numEvents));
+	events.erase(events.begin(), events.begin() + numEvents);
+	return true;
+}
+
+bool HybridEventStore::HasLeasedEvents(int requestId) const
+{
+	return leasedBatches.find(requestId) != leasedBatches.end() || persistentRequests.find(requestId) != persistentRequests.end();
+}
+
+bool HybridEventStore::ReleaseEvents(int requestId)
+{
+	if (persistentRequests.erase(requestId) > 0)
+	{
+		hasPersistentEvents = true;
+		return persistentStore->ReleaseEvents(requestId);
+	}
+
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	Batch batch = std::move(it->second);
+	leasedBatches.erase(it);
+
+	if (!isConnected)
+	{
+		if (!persistentStore->BeginTransaction())
+			return false;
+
+		const bool isSpilled = SpillBatch(batch);
+		return persistentStore->CommitTransaction() && isSpilled;
+	}
+
+	numReleasedEvents += batch.events.size();
+	releasedBatches[batch.events.front().sequence] = std::move(batch);
+	return true;
+}
+
+bool HybridEventStore::DeleteLeasedEvents(int requestId)
+{
+	if (persistentRequests.erase(requestId) > 0)
+		return persistentStore->DeleteLeasedEvents(requestId);
+
+	leasedBatches.erase(requestId);
+	return true;
+}
+
+bool HybridEventStore::RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference)
+{
+	if (persistentRequests.find(requestId) != persistentRequests.end())
+		return persistentStore->RetrieveLeasedEvents(requestId, outJson, serverTimeDifference);
+
+	std::unordered_map<int, Batch>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	EventWriter writer;
+	for (std::vector<MemoryEvent>::const_iterator event = it->second.events.begin(); event != it->second.events.end(); ++event)
+	{
+		writer.Clear();
+		writer.BeginObject();
+		writer.WriteMembers(*event->defaultAnnotations);
+		writer.WriteInt("client_ts", event->clientTimestamp + serverTimeDifference);
+		if (!EventEncoder::WriteJson(event->encodedEvent.data(), event->encodedEvent.size(), serverTimeDifference, writer))
+		{
+			assert(false);
+			continue;
+		}
+		writer.EndObject();
+
+		outJson += outJson.empty() ? '[' : ',';
+		outJson += writer.GetBuffer();
+	}
+
+	if (!outJson.empty())
+		outJson += ']';
+
+	return true;
+}
+
+bool HybridEventStore::GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference)
+{
+	outHasPayload = false;
+
+	if (persistentRequests.find(requestId) != persistentRequests.end())
+		return persistentStore->GetLeasedPayload(requestId, outHasPayload, outPayload, outHmac, outServerTimeDifference);
+
+	std::unordered_map<int, Batch>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	outHasPayload = it->second.hasPayload;
+	outPayload = it->second.payload;
+	outHmac = it->second.hmac;
+	outServerTimeDifference = it->second.serverTimeDifference;
+	return true;
+}
+
+bool HybridEventStore::SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference)
+{
+	if (persistentRequests.find(requestId) != persistentRequests.end())
+		return persistentStore->SetLeasedPayload(requestId, payload, hmac, serverTimeDifference);
+
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
+
+	it->second.hasPayload = true;
+	it->second.payload = payload;
+	it->second.hmac = hmac;
+	it->second.serverTimeDifference = serverTimeDifference;
+	return true;
+}
+
+bool HybridEventStore::ClearLeasedPayload(int requestId)
+{
+	if (persistentRequests.find(requestId) != persistentRequests.end())
+		return persistentStore->ClearLeasedPayload(requestId);
+
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
+
+	it->second.hasPayload = false;
+	it->second.payload.clear();
+	it->second.hmac.clear();
+	it->second.serverTimeDifference = 0;
+	return true;
+}
+
+bool HybridEventStore::AddLeasedAttempt(int requestId, int& outNumAttempts)
+{
+	if (persistentRequests.find(requestId) != persistentRequests.end())
+		return persistentStore->AddLeasedAttempt(requestId, outNumAttempts);
+
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
+
+	outNumAttempts = ++it->second.attempts;
+	return true;
+}
+
+bool HybridEventStore::SpillEvents()
+{
+	if (!persistentStore->BeginTransaction())
+		return false;
+
+	// Released batches are older than the events that weren't leased yet
+	bool succeeded = true;
+	for (std::map<unsigned long long, Batch>::const_iterator it = releasedBatches.begin(); it != releasedBatches.end(); ++it)
+		succeeded &= SpillBatch(it->second);
+
+	for (std::deque<MemoryEvent>::const_iterator event = events.begin(); event != events.end(); ++event)
+		succeeded &= persistentStore->AddEvent(*event->defaultAnnotations, event->clientTimestamp, event->encodedEvent, event->priority);
+
+	releasedBatches.clear();
+	numReleasedEvents = 0;
+	events.clear();
+	hasPersistentEvents = true;
+
+	return persistentStore->CommitTransaction() && succeeded;
+}
+
+bool HybridEventStore::SpillBatch(const Batch& batch)
+{
+	bool succeeded = true;
+	for (std::vector<MemoryEvent>::const_iterator event = batch.events.begin(); event != batch.events.end(); ++event)
+		succeeded &= persistentStore->AddEvent(*event->defaultAnnotations, event->clientTimestamp, event->encodedEvent, event->priority);
+
+	hasPersistentEvents = true;
+	return succeeded;
+}
\ No newline at end of file
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "IEventStore.h"
+
+namespace Analytics
+{
+	// Keeps events in memory while they are sent as fast as they come in, so most events never touch the disk.
+	// They are spilled to the persistent store when more than spillThreshold events are waiting, while there is no
+	// connection, and by Spill() when the game shuts down. Spilled events are sent before the events in memory.
+	// Events in memory are lost when the game crashes.
+	class HybridEventStore : public IEventStore
+	{
+	public:
+		HybridEventStore();
+
+		void Initialize(IEventStore* persistentStore, size_t spillThreshold);
+		bool IsInitialized() const;
+
+		// Without a connection all events are stored in the persistent store right away
+		bool SetConnected(bool isConnected);
+
+		// Moves the events in memory to the persistent store in the order in which they were added. Batches that are being
+		// sent are dropped, their payload can't be stored with them and building it again could count their events twice.
+		bool Spill();
+
+	public:
+		bool AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int priority) override;
+
+		// Also open a transaction in the persistent store, so events that are spilled or stored directly are written at once
+		bool BeginTransaction() override;
+		bool CommitTransaction() override;
+
+		bool LeaseEvents(int requestId, int amount) override;
+		bool HasLeasedEvents(int requestId) const override;
+		bool ReleaseEvents(int requestId) override;
+		bool DeleteLeasedEvents(int requestId) override;
+		bool RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference) override;
+		bool ClearLeasedPayload(int requestId) override;
+
+		bool GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference) override;
+		bool SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference) override;
+		bool AddLeasedAttempt(int requestId, int& outNumAttempts) override;
+
+	private:
+		struct MemoryEvent
+		{
+			unsigned long long sequence; // Order in which the events were added
+			std::shared_ptr<const std::string> defaultAnnotations;
+			long long clientTimestamp;
+			std::string encodedEvent;
+			int priority;
+		};
+
+		struct Batch
+		{
+			Batch() : hasPayload(false), serverTimeDifference(0), attempts(0) {}
+
+			std::vector<MemoryEvent> events;
+			bool hasPayload;
+			std::string payload;
+			std::string hmac;
+			long long serverTimeDifference;
+			int attempts;
+		};
+
+		// Leased batches are spilled when they are released
+		bool SpillEvents();
+		bool SpillBatch(const Batch& batch);
+
+	private:
+		IEventStore* persistentStore;
+		size_t spillThreshold;
+		bool isConnected;
+		bool hasPersistentEvents; // Not known after a restart, so it starts out true
+
+		std::deque<MemoryEvent> events; // Not leased yet
+		size_t numReleasedEvents;
+		unsigned long long nextSequence;
+		std::shared_ptr<const std::string> lastAnnotations; // Shared by the events that have the same default annotations
+
+		std::unordered_map<int, Batch> leasedBatches; // By request id
+		std::map<unsigned long long, Batch> releasedBatches; // By the sequence of their first event, so the oldest is sent first
+		std::unordered_set<int> persistentRequests; // Requests that leased events of the persistent store
+	};
+}
\ No newline at end of file
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+
+namespace Analytics
+{
+	// Where the events are kept until they are sent, see InitData::eventStore
+	struct EventStoreType
+	{
+		enum Enum
+		{
+			Database,		// Stored in the sqlite database, together with the sessions and progressions
+			SegmentedLog,	// Appended to log files next to the database, for servers that store a lot of events
+		};
+	};
+
+	// Stores events until GameAnalytics acknowledged them. Events are sent in batches that lease the oldest events that
+	// are not being sent yet, a batch is deleted when the server accepted it or released to be sent again when it didn't.
+	// Only used by the analytics thread.
+	class IEventStore
+	{
+	public:
+		virtual ~IEventStore() {}
+
+		// The event is encoded by an EventEncoder, without its client_ts.
+		// The default annotations are json members without the surrounding braces.
+		// Events with a lower priority are evicted first when a store has a quota.
+		virtual bool AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int priority) = 0;
+
+		// Events that are added in between are stored at once, transactions can be nested
+		virtual bool BeginTransaction() = 0;
+		virtual bool CommitTransaction() = 0;
+
+		virtual bool LeaseEvents(int requestId, int amount) = 0;
+		virtual bool HasLeasedEvents(int requestId) const = 0; // False when LeaseEvents() found nothing to send
+		virtual bool ReleaseEvents(int requestId) = 0;
+		virtual bool DeleteLeasedEvents(int requestId) = 0;
+
+		// Writes the json array of the leased events, outJson stays empty when nothing was leased
+		virtual bool RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference) = 0;
+
+		// The payload that was sent for a batch is kept with it, so it can be sent again as it is.
+		// outHasPayload is false when the batch has no payload yet or it was cleared.
+		virtual bool GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference) = 0;
+		virtual bool SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference) = 0;
+		virtual bool ClearLeasedPayload(int requestId) = 0;
+
+		// Counts the times the server rejected the batch, the count starts over when the batch is split
+		virtual bool AddLeasedAttempt(int requestId, int& outNumAttempts) = 0;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <utility>
+#include <type_traits>
+#include <assert.h>
+
+namespace Analytics
+{
+	// Bounded lock-free queue, based on Dmitry Vyukov's array queue:
+	// http://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+	// Every cell carries a sequence number that tells producers and consumers
+	// whether it is free to write or ready to read, so neither side takes a lock.
+	template<typename T>
+	class LockFreeQueue
+	{
+	public:
+		// Capacity has to be a power of two
+		explicit LockFreeQueue(size_t capacity);
+
+		template<typename U>
+		bool TryPush(U&& item);
+		bool TryPop(T& outItem);
+
+		// Only pops the oldest item when canPop(const T& item) returns true for it
+		template<typename Pred>
+		bool TryPopIf(Pred canPop, T& outItem);
+
+		// Claims count consecutive cells at once and calls fill(T& outItem, size_t index) for each of them,
+		// so the items are written straight into the queue. Fails without claiming anything if there is no room.
+		template<typename Func>
+		bool TryPushRange(size_t count, Func fill);
+
+		// Only a snapshot, the queue can change right after calling this
+		bool IsEmpty() const;
+		size_t GetCapacity() const;
+
+	private:
+		struct Cell
+		{
+			std::atomic<size_t> sequence;
+			T data;
+		};
+
+		static const size_t CacheLineSize = 64;
+
+		std::unique_ptr<Cell[]> cells;
+		const size_t mask;
+
+		// Keep the producer and consumer positions on separate cache lines
+		char padding0[CacheLineSize];
+		std::atomic<size_t> enqueuePosition;
+		char padding1[CacheLineSize];
+		std::atomic<size_t> dequeuePosition;
+		char padding2[CacheLineSize];
+
+		LockFreeQueue(const LockFreeQueue&);
+		LockFreeQueue& operator=(const LockFreeQueue&);
+	};
+
+	template<typename T>
+	LockFreeQueue<T>::LockFreeQueue(size_t capacity) :
+		cells(new Cell[capacity]),
+		mask(capacity - 1),
+		enqueuePosition(0),
+		dequeuePosition(0)
+	{
+		assert(capacity >= 2 && (capacity & (capacity - 1)) == 0); // Capacity has to be a power of two
+		for (size_t i = 0; i < capacity; ++i)
+			cells[i].sequence.store(i, std::memory_order_relaxed);
+	}
+
+	template<typename T>
+	template<typename U>
+	bool LockFreeQueue<T>::TryPush(U&& item)
+	{
+		Cell* cell;
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+			if (difference == 0)
+			{
+				if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0)
+			{
+				return false; // Full
+			}
+			else
+			{
+				position = enqueuePosition.load(std::memory_order_relaxed);
+			}
+		}
+
+		cell->data = std::forward<U>(item);
+		cell->sequence.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	template<typename T>
+	template<typename Func>
+	bool LockFreeQueue<T>::TryPushRange(size_t count, Func fill)
+	{
+		assert(count > 0 && count <= GetCapacity());
+
+		size_t position = enqueuePosition.load(std::memory_order_relaxed);
+		while (true)
+		{
+			intptr_t difference = (intptr_t)cells[position & mask].sequence.load(std::memory_order_acquire) - (intptr_t)position;
+			if (difference < 0)
+				return false; // Full
+			if (difference > 0)
+			{
+				position = enqueuePosition.load(std::memory_order_relaxed);
+				continue;
+			}
+
+			// Every cell in the range has to be free, cells can be freed out of order when there are multiple consumers
+			bool hasRoom = true;
+			for (size_t i = 1; i < count && hasRoom; ++i)
+				hasRoom = (cells[(position + i) & mask].sequence.load(std::memory_order_acquire) == position + i);
+			if (!hasRoom)
+				return false;
+
+			if (enqueuePosition.compare_exchange_weak(position, position + count, std::memory_order_relaxed))
+				break;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			Cell& cell = cells[(position + i) & mask];
+			fill(cell.data, i);
+			cell.sequence.store(position + i + 1, std::memory_order_release);
+		}
+		return true;
+	}
+
+	template<typename T>
+	bool LockFreeQueue<T>::TryPop(T& outItem)
+	{
+		Cell* cell;
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		while (true)
+		{
+			cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+			if (difference == 0)
+			{
+				if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (difference < 0)
+			{
+				return false; // Empty
+			}
+			else
+			{
+				position = dequeuePosition.load(std::memory_order_relaxed);
+			}
+		}
+
+		outItem = std::move(cell->data);
+		cell->sequence.store(position + mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	template<typename T>
+	template<typename Pred>
+	bool LockFreeQueue<T>::TryPopIf(Pred canPop, T& outItem)
+	{
+		// The item is copied before the cell is claimed, so it can be torn when another consumer claims it first.
+		// Claiming fails in that case and the copy is thrown away, which is only safe for plain data.
+		static_assert(std::is_trivially_copyable<T>::value, "TryPopIf() can only be used with trivially copyable items");
+
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		while (true)
+		{
+			Cell* cell = &cells[position & mask];
+			size_t sequence = cell->sequence.load(std::memory_order_acquire);
+			intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+			if (difference == 0)
+			{
+				outItem = cell->data;
+				if (!canPop(outItem))
+					return false;
+				if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell->sequence.store(position + mask + 1, std::memory_order_release);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false; // Empty
+			}
+			else
+			{
+				position = dequeuePosition.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	template<typename T>
+	bool LockFreeQueue<T>::IsEmpty() const
+	{
+		size_t position = dequeuePosition.load(std::memory_order_relaxed);
+		const Cell& cell = cells[position & mask];
+		return (cell.sequence.load(std::memory_order_acquire) != position + 1);
+	}
+
+	template<typename T>
+	size_t LockFreeQueue<T>::GetCapacity() const
+	{
+		return mask + 1;
+	}
+}
\ No newline at end of file
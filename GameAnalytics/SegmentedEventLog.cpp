@@ -0,0 +1,559 @@
+#include "SegmentedEventLog.h"
+
+#include "EventEncoder.h"
+#include "EventWriter.h"
+
+#include <assert.h>
+#include <iterator>
+#include <string.h>
+
+using namespace Analytics;
+
+namespace
+{
+	// Every record starts with the length of its body and a checksum of it, the body starts with the record type
+	const size_t RecordHeaderSize = 8;
+	const unsigned int MaxRecordBodySize = 16 * 1024 * 1024;
+
+	// Sequence, segment, offset and a checksum of those
+	const size_t CheckpointSize = 24;
+
+	// FNV-1a, only used to find records that were not written completely
+	unsigned int UpdateChecksum(unsigned int checksum, const char* data, size_t size)
+	{
+		for (size_t i = 0; i < size; ++i)
+		{
+			checksum ^= (unsigned char)data[i];
+			checksum *= 16777619u;
+		}
+		return checksum;
+	}
+
+	const unsigned int InitialChecksum = 2166136261u;
+
+	bool DoesFileExist(const std::string& fileName)
+	{
+		FILE* file = fopen(fileName.c_str(), "rb");
+		if (file == NULL)
+			return false;
+
+		fclose(file);
+		return true;
+	}
+}
+
+SegmentedEventLog::SegmentedEventLog() :
+	segmentSize(0),
+	transactionDepth(0),
+	writeFile(NULL),
+	writeSegment(0),
+	writeOffset(0),
+	hasWrittenAnnotations(false),
+	readFile(NULL),
+	firstSegment(0),
+	checkpointSequence(0)
+{
+}
+
+SegmentedEventLog::~SegmentedEventLog()
+{
+	if (writeFile != NULL)
+		fclose(writeFile);
+	if (readFile != NULL)
+		fclose(readFile);
+}
+
+Result::Enum SegmentedEventLog::Initialize(const char* baseFileName, size_t segmentSize)
+{
+	assert(!IsInitialized()); // Already initialized!
+
+	this->baseFileName = baseFileName;
+	this->segmentSize = segmentSize;
+
+	// Without a checkpoint nothing was sent yet, so no segment was deleted either
+	if (!ReadCheckpoint(this->baseFileName, acknowledgedPosition, checkpointSequence))
+	{
+		acknowledgedPosition = LogPosition();
+		checkpointSequence = 0;
+	}
+	firstSegment = acknowledgedPosition.segment;
+
+	// Segments are only deleted from the front, so there are no gaps after the first one.
+	// The last one can end with a record that was not written completely, new events go into a new segment.
+	writeSegment = firstSegment;
+	while (DoesFileExist(GetSegmentFileName(this->baseFileName, writeSegment)))
+		++writeSegment;
+
+	// Skip the events that were sent, but keep track of the annotations that are used by the events after them
+	readPosition = LogPosition(firstSegment, 0);
+	while (readPosition.segment == acknowledgedPosition.segment && readPosition.offset < acknowledgedPosition.offset)
+	{
+		RecordType::Enum type;
+		LogPosition position;
+		if (!ReadRecord(type, recordBody, position))
+			break;
+
+		if (type == RecordType::Annotations)
+			readAnnotations = std::make_shared<const std::string>(recordBody.substr(1));
+	}
+
+	if (readPosition.segment == acknowledgedPosition.segment && readPosition.offset != acknowledgedPosition.offset)
+	{
+		// The checkpoint doesn't match the segment, send everything that is left in it again
+		assert(false);
+		readPosition = LogPosition(firstSegment, 0);
+		readAnnotations.reset();
+	}
+
+	return Result::Ok;
+}
+
+bool SegmentedEventLog::IsInitialized() const
+{
+	return !baseFileName.empty();
+}
+
+void SegmentedEventLog::DeleteLogFiles(const char* baseFileName)
+{
+	LogPosition position;
+	unsigned long long sequence;
+	if (!ReadCheckpoint(baseFileName, position, sequence))
+		position = LogPosition();
+
+	for (int segment = position.segment; std::remove(GetSegmentFileName(baseFileName, segment).c_str()) == 0; ++segment)
+	{
+	}
+
+	std::remove(GetCheckpointFileName(baseFileName, 0).c_str());
+	std::remove(GetCheckpointFileName(baseFileName, 1).c_str());
+}
+
+bool SegmentedEventLog::AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int /*priority*/)
+{
+	if (!IsInitialized())
+		return false;
+
+	if (writeFile == NULL)
+	{
+		writeFile = fopen(GetSegmentFileName(baseFileName, writeSegment).c_str(), "wb");
+		if (writeFile == NULL)
+			return false;
+
+		writeOffset = 0;
+		hasWrittenAnnotations = false;
+	}
+
+	// Every segment starts with annotations, so its events can be read without the segments before it
+	if (!hasWrittenAnnotations || defaultAnnotations != writtenAnnotations)
+	{
+		if (!WriteRecord(RecordType::Annotations, NULL, 0, defaultAnnotations))
+			return false;
+
+		writtenAnnotations = defaultAnnotations;
+		hasWrittenAnnotations = true;
+	}
+
+	char timestamp[sizeof(long long)];
+	memcpy(timestamp, &clientTimestamp, sizeof(long long));
+	if (!WriteRecord(RecordType::Event, timestamp, sizeof(timestamp), encodedEvent))
+		return false;
+
+	if ((size_t)writeOffset >= segmentSize)
+	{
+		// Start a new segment with the next event
+		if (fclose(writeFile) != 0)
+		{
+			writeFile = NULL;
+			return false;
+		}
+		writeFile = NULL;
+		++writeSegment;
+	}
+	else if (transactionDepth == 0 && fflush(writeFile) != 0)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+bool SegmentedEventLog::BeginTransaction()
+{
+	++transactionDepth;
+	return true;
+}
+
+bool SegmentedEventLog::CommitTransaction()
+{
+	assert(transactionDepth > 0);
+	if (transactionDepth == 0 || --transactionDepth > 0)
+		return true;
+
+	return (writeFile == NULL || fflush(writeFile) == 0);
+}
+
+bool SegmentedEventLog::LeaseEvents(int requestId, int amount)
+{
+	if (!IsInitialized())
+		return false;
+
+	assert(amount > 0);
+	assert(leasedBatches.find(requestId) == leasedBatches.end());
+
+	// Released batches go first, they are split when less events fit in a request than before
+	if (!releasedBatches.empty())
+	{
+		std::map<LogPosition, Batch>::iterator it = releasedBatches.begin();
+		Batch& released = it->second;
+		if (released.events.size() <= (size_t)amount)
+		{
+			leasedBatches[requestId] = std::move(released);
+			releasedBatches.erase(it);
+			return true;
+		}
+
+		Batch& leased = leasedBatches[requestId];
+		leased.events.assign(std::make_move_iterator(released.events.begin()), std::make_move_iterator(released.events.begin() + amount));
+
+		Batch remainder;
+		remainder.events.assign(std::make_move_iterator(released.events.begin() + amount), std::make_move_iterator(released.events.end()));
+		releasedBatches.erase(it);
+		releasedBatches[remainder.events.front().position] = std::move(remainder);
+		return true;
+	}
+
+	// The reader can't see what the writer didn't hand to the operating system yet
+	if (writeFile != NULL && fflush(writeFile) != 0)
+		return false;
+
+	Batch batch;
+	LoggedEvent loggedEvent;
+	while (batch.events.size() < (size_t)amount && ReadNextEvent(loggedEvent))
+		batch.events.push_back(std::move(loggedEvent));
+
+	if (batch.events.empty())
+		return true; // Nothing to send
+
+	leasedBatches[requestId] = std::move(batch);
+	return true;
+}
+
+bool SegmentedEventLog::HasLeasedEvents(int requestId) const
+{
+	return leasedBatches.find(requestId) != leasedBatches.end();
+}
+
+bool SegmentedEventLog::ReleaseEvents(int requestId)
+{
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	releasedBatches[it->second.events.front().position] = std::move(it->second);
+	leasedBatches.erase(it);
+	return true;
+}
+
+bool SegmentedEventLog::DeleteLeasedEvents(int requestId)
+{
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	leasedBatches.erase(it);
+
+	// Only the oldest batch moves the checkpoint, batches that are deleted out of order are sent again after a restart
+	const LogPosition position = GetAcknowledgedPosition();
+	if (!(acknowledgedPosition < position))
+		return true;
+
+	if (!WriteCheckpoint(position))
+		return false;
+	acknowledgedPosition = position;
+
+	// The checkpoint is written first, so a segment is never needed after it was deleted
+	for (; firstSegment < acknowledgedPosition.segment; ++firstSegment)
+		std::remove(GetSegmentFileName(baseFileName, firstSegment).c_str());
+
+	return true;
+}
+
+bool SegmentedEventLog::RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference)
+{
+	std::unordered_map<int, Batch>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	EventWriter writer;
+	for (std::vector<LoggedEvent>::const_iterator event = it->second.events.begin(); event != it->second.events.end(); ++event)
+	{
+		writer.Clear();
+		writer.BeginObject();
+		if (event->defaultAnnotations)
+			writer.WriteMembers(*event->defaultAnnotations);
+		writer.WriteInt("client_ts", event->clientTimestamp + serverTimeDifference);
+		if (!EventEncoder::WriteJson(event->encodedEvent.data(), event->encodedEvent.size(), serverTimeDifference, writer))
+		{
+			assert(false);
+			continue;
+		}
+		writer.EndObject();
+
+		outJson += outJson.empty() ? '[' : ',';
+		outJson += writer.GetBuffer();
+	}
+
+	if (!outJson.empty())
+		outJson += ']';
+
+	return true;
+}
+
+bool SegmentedEventLog::GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference)
+{
+	outHasPayload = false;
+
+	std::unordered_map<int, Batch>::const_iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return true;
+
+	outHasPayload = it->second.hasPayload;
+	outPayload = it->second.payload;
+	outHmac = it->second.hmac;
+	outServerTimeDifference = it->second.serverTimeDifference;
+	return true;
+}
+
+bool SegmentedEventLog::SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference)
+{
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
+
+	it->second.hasPayload = true;
+	it->second.payload = payload;
+	it->second.hmac = hmac;
+	it->second.serverTimeDifference = serverTimeDifference;
+	return true;
+}
+
+bool SegmentedEventLog::ClearLeasedPayload(int requestId)
+{
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
+
+	it->second.hasPayload = false;
+	it->second.payload.clear();
+	it->second.hmac.clear();
+	it->second.serverTimeDifference = 0;
+	return true;
+}
+
+bool SegmentedEventLog::AddLeasedAttempt(int requestId, int& outNumAttempts)
+{
+	std::unordered_map<int, Batch>::iterator it = leasedBatches.find(requestId);
+	if (it == leasedBatches.end())
+		return false;
+
+	outNumAttempts = ++it->second.attempts;
+	return true;
+}
+
+std::string SegmentedEventLog::GetSegmentFileName(const std::string& baseFileName, int segment)
+{
+	return baseFileName + ".segment" + std::to_string(segment);
+}
+
+std::string SegmentedEventLog::GetCheckpointFileName(const std::string& baseFileName, int slot)
+{
+	return baseFileName + ".checkpoint" + std::to_string(slot);
+}
+
+bool SegmentedEventLog::ReadCheckpoint(const std::string& baseFileName, LogPosition& outPosition, unsigned long long& outSequence)
+{
+	// The checkpoint is written to both files in turn, so one of them is still valid when writing the other one is interrupted
+	bool hasCheckpoint = false;
+	for (int slot = 0; slot < 2; ++slot)
+	{
+		FILE* file = fopen(GetCheckpointFileName(baseFileName, slot).c_str(), "rb");
+		if (file == NULL)
+			continue;
+
+		char data[CheckpointSize];
+		const size_t readSize = fread(data, 1, CheckpointSize, file);
+		fclose(file);
+
+		unsigned int checksum;
+		memcpy(&checksum, data + 20, sizeof(checksum));
+		if (readSize != CheckpointSize || checksum != UpdateChecksum(InitialChecksum, data, 20))
+			continue;
+
+		unsigned long long sequence;
+		int segment;
+		int offset;
+		memcpy(&sequence, data, sizeof(sequence));
+		memcpy(&segment, data + 8, sizeof(segment));
+		memcpy(&offset, data + 12, sizeof(offset));
+		if (hasCheckpoint && sequence < outSequence)
+			continue;
+
+		outSequence = sequence;
+		outPosition = LogPosition(segment, offset);
+		hasCheckpoint = true;
+	}
+
+	return hasCheckpoint;
+}
+
+bool SegmentedEventLog::WriteRecord(RecordType::Enum type, const char* header, size_t headerSize, const std::string& data)
+{
+	const char typeByte = (char)type;
+	const unsigned int bodySize = (unsigned int)(1 + headerSize + data.size());
+	assert(bodySize <= MaxRecordBodySize);
+
+	unsigned int checksum = UpdateChecksum(InitialChecksum, &typeByte, 1);
+	checksum = UpdateChecksum(checksum, header, headerSize);
+	checksum = UpdateChecksum(checksum, data.data(), data.size());
+
+	char recordHeader[RecordHeaderSize];
+	memcpy(recordHeader, &bodySize, sizeof(bodySize));
+	memcpy(recordHeader + 4, &checksum, sizeof(checksum));
+
+	if (fwrite(recordHeader, 1, RecordHeaderSize, writeFile) != RecordHeaderSize ||
+		fwrite(&typeByte, 1, 1, writeFile) != 1 ||
+		fwrite(header, 1, headerSize, writeFile) != headerSize ||
+		fwrite(data.data(), 1, data.size(), writeFile) != data.size())
+	{
+		return false;
+	}
+
+	writeOffset += (long)(RecordHeaderSize + bodySize);
+	return true;
+}
+
+bool SegmentedEventLog::ReadRecord(RecordType::Enum& outType, std::string& outBody, LogPosition& outPosition)
+{
+	// Moves to the next segment at the end of a segment, or at a record that was not written completely
+	while (true)
+	{
+		if (readFile == NULL)
+		{
+			if (readPosition.segment >= writeSegment && writeFile == NULL)
+				return false;
+
+			readFile = fopen(GetSegmentFileName(baseFileName, readPosition.segment).c_str(), "rb");
+			if (readFile == NULL)
+				return false;
+		}
+
+		// Seeking also makes the reader see what was appended since its last read
+		char recordHeader[RecordHeaderSize];
+		unsigned int bodySize = 0;
+		unsigned int checksum = 0;
+		bool isValid = (fseek(readFile, readPosition.offset, SEEK_SET) == 0 && fread(recordHeader, 1, RecordHeaderSize, readFile) == RecordHeaderSize);
+		if (isValid)
+		{
+			memcpy(&bodySize, recordHeader, sizeof(bodySize));
+			memcpy(&checksum, recordHeader + 4, sizeof(checksum));
+			isValid = (bodySize > 0 && bodySize <= MaxRecordBodySize);
+		}
+		if (isValid)
+		{
+			outBody.resize(bodySize);
+			isValid = (fread(&outBody[0], 1, bodySize, readFile) == bodySize && checksum == UpdateChecksum(InitialChecksum, outBody.data(), bodySize));
+		}
+
+		if (isValid)
+		{
+			outPosition = readPosition;
+			readPosition.offset += (long)(RecordHeaderSize + bodySize);
+			outType = (RecordType::Enum)outBody[0];
+			return true;
+		}
+
+		// The segment that is being written only ends when the writer moves on
+		if (readPosition.segment >= writeSegment)
+			return false;
+
+		fclose(readFile);
+		readFile = NULL;
+		readPosition = LogPosition(readPosition.segment + 1, 0);
+		readAnnotations.reset();
+	}
+}
+
+bool SegmentedEventLog::ReadNextEvent(LoggedEvent& outEvent)
+{
+	RecordType::Enum type;
+	LogPosition position;
+	while (ReadRecord(type, recordBody, position))
+	{
+		switch (type)
+		{
+		case RecordType::Annotations:
+			readAnnotations = std::make_shared<const std::string>(recordBody.substr(1));
+			break;
+
+		case RecordType::Event:
+			if (recordBody.size() < 1 + sizeof(long long))
+			{
+				assert(false);
+				break;
+			}
+
+			outEvent.position = position;
+			outEvent.defaultAnnotations = readAnnotations;
+			memcpy(&outEvent.clientTimestamp, recordBody.data() + 1, sizeof(long long));
+			outEvent.encodedEvent.assign(recordBody, 1 + sizeof(long long), std::string::npos);
+			return true;
+
+		default:
+			assert(false); // Written by a newer version
+			break;
+		}
+	}
+
+	return false;
+}
+
+bool SegmentedEventLog::WriteCheckpoint(const LogPosition& position)
+{
+	const unsigned long long sequence = checkpointSequence + 1;
+	const int offset = (int)position.offset;
+
+	char data[CheckpointSize];
+	memcpy(data, &sequence, sizeof(sequence));
+	memcpy(data + 8, &position.segment, sizeof(position.segment));
+	memcpy(data + 12, &offset, sizeof(offset));
+	memset(data + 16, 0, 4);
+	const unsigned int checksum = UpdateChecksum(InitialChecksum, data, 20);
+	memcpy(data + 20, &checksum, sizeof(checksum));
+
+	FILE* file = fopen(GetCheckpointFileName(baseFileName, (int)(sequence % 2)).c_str(), "wb");
+	if (file == NULL)
+		return false;
+
+	const bool isWritten = (fwrite(data, 1, CheckpointSize, file) == CheckpointSize);
+	if (fclose(file) != 0 || !isWritten)
+		return false;
+
+	checkpointSequence = sequence;
+	return true;
+}
+
+SegmentedEventLog::LogPosition SegmentedEventLog::GetAcknowledgedPosition() const
+{
+	// Everything before the oldest batch and before the reader was sent
+	LogPosition position = readPosition;
+	if (!releasedBatches.empty() && releasedBatches.begin()->first < position)
+		position = releasedBatches.begin()->first;
+
+	for (std::unordered_map<int, Batch>::const_iterator it = leasedBatches.begin(); it != leasedBatches.end(); ++it)
+	{
+		if (it->second.events.front().position < position)
+			position = it->second.events.front().position;
+	}
+
+	return position;
+}
\ No newline at end of file
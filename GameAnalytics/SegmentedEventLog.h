@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "GameAnalyticsResult.h"
+#include "IEventStore.h"
+
+namespace Analytics
+{
+	// Appends events to segment files next to the database, so storing an event is a sequential write without any index
+	// to maintain. Records are length prefixed and a new segment is started when the current one is full. A checkpoint
+	// file holds the position up to which all events were sent, segments before it are deleted as a whole.
+	// Batches are only kept in memory, events after the checkpoint are sent again after a restart.
+	class SegmentedEventLog : public IEventStore
+	{
+	public:
+		SegmentedEventLog();
+		~SegmentedEventLog();
+
+		// The files are named after baseFileName, segments are a little larger than segmentSize bytes at most
+		Result::Enum Initialize(const char* baseFileName, size_t segmentSize);
+		bool IsInitialized() const;
+
+		static void DeleteLogFiles(const char* baseFileName);
+
+	public:
+		// Default annotations are only written again when they are different from the ones of the previous event.
+		// The log has no quota, so the priority isn't stored.
+		bool AddEvent(const std::string& defaultAnnotations, long long clientTimestamp, const std::string& encodedEvent, int priority) override;
+
+		// The events are handed to the operating system when the outermost transaction is committed
+		bool BeginTransaction() override;
+		bool CommitTransaction() override;
+
+		bool LeaseEvents(int requestId, int amount) override;
+		bool HasLeasedEvents(int requestId) const override;
+		bool ReleaseEvents(int requestId) override;
+		bool DeleteLeasedEvents(int requestId) override;
+		bool RetrieveLeasedEvents(int requestId, std::string& outJson, long long serverTimeDifference) override;
+		bool ClearLeasedPayload(int requestId) override;
+
+		// Payloads are only kept in memory
+		bool GetLeasedPayload(int requestId, bool& outHasPayload, std::string& outPayload, std::string& outHmac, long long& outServerTimeDifference) override;
+		bool SetLeasedPayload(int requestId, const std::string& payload, const std::string& hmac, long long serverTimeDifference) override;
+		bool AddLeasedAttempt(int requestId, int& outNumAttempts) override;
+
+	private:
+		struct RecordType
+		{
+			enum Enum
+			{
+				Annotations = 1,	// Default annotations of the events after it
+				Event,				// Client timestamp, followed by the encoded event
+			};
+		};
+
+		struct LogPosition
+		{
+			LogPosition() : segment(0), offset(0) {}
+			LogPosition(int segment, long offset) : segment(segment), offset(offset) {}
+
+			bool operator<(const LogPosition& other) const { return (segment != other.segment) ? (segment < other.segment) : (offset < other.offset); }
+
+			int segment;
+			long offset;
+		};
+
+		struct LoggedEvent
+		{
+			LogPosition position;
+			std::shared_ptr<const std::string> defaultAnnotations;
+			long long clientTimestamp;
+			std::string encodedEvent;
+		};
+
+		struct Batch
+		{
+			Batch() : hasPayload(false), serverTimeDifference(0), attempts(0) {}
+
+			std::vector<LoggedEvent> events;
+			bool hasPayload;
+			std::string payload;
+			std::string hmac;
+			long long serverTimeDifference;
+			int attempts;
+		};
+
+		static std::string GetSegmentFileName(const std::string& baseFileName, int segment);
+		static std::string GetCheckpointFileName(const std::string& baseFileName, int slot);
+		static bool ReadCheckpoint(const std::string& baseFileName, LogPosition& outPosition, unsigned long long& outSequence);
+
+		bool WriteRecord(RecordType::Enum type, const char* header, size_t headerSize, const std::string& data);
+		bool ReadRecord(RecordType::Enum& outType, std::string& outBody, LogPosition& outPosition);
+		bool ReadNextEvent(LoggedEvent& outEvent);
+		bool WriteCheckpoint(const LogPosition& position);
+		LogPosition GetAcknowledgedPosition() const;
+
+	private:
+		std::string baseFileName;
+		size_t segmentSize;
+		int transactionDepth;
+
+		FILE* writeFile; // Opened when the first event of a segment is written
+		int writeSegment;
+		long writeOffset;
+		bool hasWrittenAnnotations; // To the current segment
+		std::string writtenAnnotations;
+
+		FILE* readFile;
+		LogPosition readPosition; // Events before this one are in a batch or were sent
+		std::shared_ptr<const std::string> readAnnotations;
+		std::string recordBody; // Reused for every record that is read
+
+		int firstSegment;
+		LogPosition acknowledgedPosition;
+		unsigned long long checkpointSequence;
+
+		std::unordered_map<int, Batch> leasedBatches; // By request id
+		std::map<LogPosition, Batch> releasedBatches; // By the position of their first event, so the oldest is sent first
+	};
+}
\ No newline at end of file
@@ -1,6 +1,8 @@
 #include "SystemHelpers.h"
 
 #include <vector>
+#include <atomic>
+#include <chrono>
 #include <xlocbuf>
 #include <codecvt>
 
@@ -323,7 +325,61 @@ long long Timing::Frequency()
 	return li.QuadPart;
 }
 
+namespace
+{
+	// Returns the number of counter ticks between the unix epoch and the start of the counter
+	long long MeasureUnixOffset(long long counterFrequency)
+	{
+		// Take the wall clock between two counter reads, so it can be matched with the counter value in the middle
+		const long long counterBefore = Timing::Counter();
+		const std::chrono::system_clock::duration wallClock = std::chrono::system_clock::now().time_since_epoch();
+		const long long counterAfter = Timing::Counter();
+
+		const double unixSeconds = std::chrono::duration<double>(wallClock).count();
+		return (long long)(unixSeconds * (double)counterFrequency) - (counterBefore + (counterAfter - counterBefore) / 2);
+	}
+
+	struct Calibration
+	{
+		Calibration() :
+			counterFrequency(Timing::Frequency()),
+			secondsPerTick(1.0 / (double)counterFrequency),
+			unixOffset(MeasureUnixOffset(counterFrequency)),
+			lastCalibrationCounter(Timing::Counter())
+		{
+		}
+
+		const long long counterFrequency;
+		const double secondsPerTick;
+		std::atomic<long long> unixOffset;
+		std::atomic<long long> lastCalibrationCounter;
+	};
+
+	// Calibrated on first use instead of at static initialization, so timestamps taken by constructors of globals in other files are valid
+	Calibration& GetCalibration()
+	{
+		static Calibration calibration;
+		return calibration;
+	}
+}
+
 long long Timing::GetNowTime()
 {
-	return Counter() / Frequency();
+	const Calibration& calibration = GetCalibration();
+	return (long long)((double)(Counter() + calibration.unixOffset.load(std::memory_order_relaxed)) * calibration.secondsPerTick);
+}
+
+void Timing::Calibrate()
+{
+	Calibration& calibration = GetCalibration();
+	calibration.unixOffset.store(MeasureUnixOffset(calibration.counterFrequency), std::memory_order_relaxed);
+	calibration.lastCalibrationCounter.store(Counter(), std::memory_order_relaxed);
+}
+
+void Timing::CalibrateIfOlderThan(float seconds)
+{
+	const Calibration& calibration = GetCalibration();
+	const long long ticksSinceCalibration = Counter() - calibration.lastCalibrationCounter.load(std::memory_order_relaxed);
+	if ((double)ticksSinceCalibration * calibration.secondsPerTick >= seconds)
+		Calibrate();
 }
\ No newline at end of file
@@ -27,11 +27,18 @@ namespace Analytics
 #endif
 	};
 
+	// GetNowTime() returns unix time in seconds, but is read from the performance counter so it only costs a
+	// counter read and a multiply. The offset between the counter and the wall clock is measured at startup
+	// and again by Calibrate(), which should be called every now and then so long sessions don't drift.
 	class Timing
 	{
 	public:
 		static long long Counter();
 		static long long Frequency();
 		static long long GetNowTime();
+
+		static void Calibrate();
+		// Only calibrates when the last calibration is older than the given number of seconds
+		static void CalibrateIfOlderThan(float seconds);
 	};
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+#include "Tests.h"
+
+#include "GameAnalyticsDatabase.h"
+
+#include <sqlite/sqlite3.h>
+
+using namespace Analytics;
+
+namespace
+{
+	const char* const DatabaseFile = "migration_test.db";
+
+	// Tables as they were created before the database had a schema version
+	bool CreateBaselineDatabase(const char* databaseFile, const char* query)
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(databaseFile);
+
+		sqlite3* database = NULL;
+		if (sqlite3_open(databaseFile, &database) != SQLITE_OK)
+			return false;
+
+		std::string baselineQuery;
+		baselineQuery += "CREATE TABLE `events` (`json` TEXT NOT NULL, `is_sent` INTEGER NOT NULL DEFAULT 0);";
+		baselineQuery += "CREATE TABLE `key_value` (`key` TEXT NOT NULL UNIQUE, `value` INTEGER, PRIMARY KEY(key));";
+		baselineQuery += "CREATE TABLE `session_end` ( `session_start_ts` INTEGER NOT NULL, `session_id` TEXT NOT NULL UNIQUE, `last_event_default_annotations` TEXT NOT NULL, PRIMARY KEY(session_id));";
+		baselineQuery += "CREATE TABLE `progression` (`progression_event_id` TEXT NOT NULL UNIQUE, `attempt_num` INTEGER NOT NULL DEFAULT 0, PRIMARY KEY(progression_event_id));";
+		baselineQuery += query;
+
+		const bool isCreated = (sqlite3_exec(database, baselineQuery.c_str(), NULL, NULL, NULL) == SQLITE_OK);
+		sqlite3_close(database);
+		return isCreated;
+	}
+}
+
+bool Tests::UpgradeBaselineSessionEnd()
+{
+	// The baseline kept the whole json of the last event of the session, as written by Json::FastWriter
+	const char* const lastEvent = "{\"build\":\"v1.0.0\",\"category\":\"design\",\"client_ts\":1500000123,\"device\":\"unknown\",\"event_id\":\"GamePlay:Kill:AlienSmurf\","
+		"\"manufacturer\":\"unknown\",\"os_version\":\"windows 10\",\"platform\":\"windows\",\"progression\":\"Campaign:Level1\",\"sdk_version\":\"rest api v2\","
+		"\"session_id\":\"de305d54-75b4-431b-adb2-eb6b9e546014\",\"session_num\":3,\"user_id\":\"user\",\"v\":2,\"value\":10.0}\n";
+
+	std::string query = "INSERT INTO `session_end` (`session_start_ts`, `session_id`, `last_event_default_annotations`) VALUES(1500000000, 'de305d54-75b4-431b-adb2-eb6b9e546014', '";
+	query += lastEvent;
+	query += "');";
+	TEST_CHECK(CreateBaselineDatabase(DatabaseFile, query.c_str()));
+
+	std::vector<GameAnalyticsDatabase::SessionEndData> sessionEnds;
+	{
+		GameAnalyticsDatabase database;
+		TEST_CHECK(database.Initialize(DatabaseFile, DurabilityProfile::Balanced) == Result::Ok);
+		TEST_CHECK(database.GetAllSessionEnds(sessionEnds));
+	}
+	GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+	TEST_CHECK(sessionEnds.size() == 1);
+	TEST_CHECK(sessionEnds[0].sessionId == "de305d54-75b4-431b-adb2-eb6b9e546014");
+	TEST_CHECK(sessionEnds[0].sessionStartTimestamp == 1500000000);
+	TEST_CHECK(sessionEnds[0].lastEventTimestamp == 1500000123);
+
+	// Only the default annotations are kept, without the fields of the event itself
+	TEST_CHECK(sessionEnds[0].defaultAnnotations == "\"device\":\"unknown\",\"v\":2,\"user_id\":\"user\",\"sdk_version\":\"rest api v2\",\"os_version\":\"windows 10\","
+		"\"manufacturer\":\"unknown\",\"platform\":\"windows\",\"session_id\":\"de305d54-75b4-431b-adb2-eb6b9e546014\",\"session_num\":3,\"build\":\"v1.0.0\","
+		"\"progression\":\"Campaign:Level1\"");
+	return true;
+}
+
+bool Tests::UpgradeBaselineEvents()
+{
+	// The second event was being sent when the game stopped, the one in between was sent already
+	std::string query = "INSERT INTO `events` (`json`, `is_sent`) VALUES('{\"category\":\"user\",\"client_ts\":1500000001}\n', 0);";
+	query += "INSERT INTO `events` (`json`, `is_sent`) VALUES('{\"category\":\"design\",\"client_ts\":1500000002,\"event_id\":\"Kill\"}\n', 0);";
+	query += "DELETE FROM `events` WHERE `_rowid_` = 2;";
+	query += "INSERT INTO `events` (`json`, `is_sent`) VALUES('{\"category\":\"design\",\"client_ts\":1500000003,\"event_id\":\"Kill:\\\"Smurf\\\"\"}\n', 1);";
+	query += "INSERT INTO `events` (`json`, `is_sent`) VALUES('{\"category\":\"session_end\",\"client_ts\":1500000004,\"length\":3}\n', 0);";
+	TEST_CHECK(CreateBaselineDatabase(DatabaseFile, query.c_str()));
+
+	std::string json;
+	{
+		GameAnalyticsDatabase database;
+		TEST_CHECK(database.Initialize(DatabaseFile, DurabilityProfile::Balanced) == Result::Ok);
+		TEST_CHECK(database.LeaseEvents(1, 10));
+		TEST_CHECK(database.RetrieveLeasedEvents(1, json, 100));
+
+		// A new event comes after the migrated ones
+		std::string nextJson;
+		TEST_CHECK(database.AddEvent("\"v\":2", 1500000005, std::string(), 0));
+		TEST_CHECK(database.LeaseEvents(2, 10));
+		TEST_CHECK(database.HasLeasedEvents(2));
+		TEST_CHECK(database.RetrieveLeasedEvents(2, nextJson, 100));
+		TEST_CHECK(nextJson == "[{\"v\":2,\"client_ts\":1500000105}]");
+	}
+	GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+	// All stored events are sent in the order in which they were added, moved to server time
+	TEST_CHECK(json == "[{\"category\":\"user\",\"client_ts\":1500000101},"
+		"{\"category\":\"design\",\"client_ts\":1500000103,\"event_id\":\"Kill:\\\"Smurf\\\"\"},"
+		"{\"category\":\"session_end\",\"client_ts\":1500000104,\"length\":3}]");
+	return true;
+}
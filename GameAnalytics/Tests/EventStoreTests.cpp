@@ -0,0 +1,149 @@
+#include "Tests.h"
+
+#include "EventEncoder.h"
+#include "GameAnalyticsDatabase.h"
+#include "HybridEventStore.h"
+
+using namespace Analytics;
+
+namespace
+{
+	const char* const DatabaseFile = "event_store_test.db";
+
+	bool AddEvents(IEventStore& eventStore, int numEvents)
+	{
+		EventEncoder encoder;
+		for (int i = 0; i < numEvents; ++i)
+		{
+			encoder.Clear();
+			encoder.WriteString("category", "design");
+			encoder.WriteString("event_id", "GamePlay:Kill:AlienSmurf");
+			encoder.WriteInt("value", i);
+			if (!eventStore.AddEvent("\"v\":2,\"user_id\":\"user\"", 1500000000 + i, encoder.GetBuffer(), 0))
+				return false;
+		}
+		return true;
+	}
+
+	// Does what the analytics thread does when a request fails without an answer of the server (status 0), more often
+	// than a batch may be rejected
+	bool CheckUnansweredBatch(IEventStore& eventStore)
+	{
+		TEST_CHECK(AddEvents(eventStore, 3));
+
+		std::string json;
+		int requestId = 0;
+		for (int i = 0; i < 30; ++i)
+		{
+			++requestId;
+			TEST_CHECK(eventStore.LeaseEvents(requestId, 10));
+			TEST_CHECK(eventStore.HasLeasedEvents(requestId));
+
+			std::string leasedJson;
+			TEST_CHECK(eventStore.RetrieveLeasedEvents(requestId, leasedJson, 0));
+			TEST_CHECK(!leasedJson.empty());
+			TEST_CHECK(json.empty() || leasedJson == json);
+			json = leasedJson;
+
+			TEST_CHECK(eventStore.SetLeasedPayload(requestId, leasedJson, "hmac", 0));
+			TEST_CHECK(eventStore.ReleaseEvents(requestId));
+		}
+
+		// The payload was kept and nothing counted as a rejection
+		++requestId;
+		TEST_CHECK(eventStore.LeaseEvents(requestId, 10));
+
+		bool hasPayload = false;
+		std::string payload;
+		std::string hmac;
+		long long serverTimeDifference = 0;
+		TEST_CHECK(eventStore.GetLeasedPayload(requestId, hasPayload, payload, hmac, serverTimeDifference));
+		TEST_CHECK(hasPayload);
+		TEST_CHECK(payload == json);
+		TEST_CHECK(hmac == "hmac");
+
+		int numAttempts = 0;
+		TEST_CHECK(eventStore.AddLeasedAttempt(requestId, numAttempts));
+		TEST_CHECK(numAttempts == 1);
+
+		// A rejected batch is built again, an empty payload still counts as one
+		TEST_CHECK(eventStore.ClearLeasedPayload(requestId));
+		hasPayload = true;
+		TEST_CHECK(eventStore.GetLeasedPayload(requestId, hasPayload, payload, hmac, serverTimeDifference));
+		TEST_CHECK(!hasPayload);
+
+		TEST_CHECK(eventStore.SetLeasedPayload(requestId, std::string(), std::string(), 0));
+		TEST_CHECK(eventStore.GetLeasedPayload(requestId, hasPayload, payload, hmac, serverTimeDifference));
+		TEST_CHECK(hasPayload);
+		TEST_CHECK(payload.empty());
+		return true;
+	}
+}
+
+bool Tests::KeepUnansweredBatches()
+{
+	bool isPassed;
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+		GameAnalyticsDatabase database;
+		TEST_CHECK(database.Initialize(DatabaseFile, DurabilityProfile::Balanced) == Result::Ok);
+		isPassed = CheckUnansweredBatch(database);
+	}
+	TEST_CHECK(isPassed);
+
+	// Batches in memory are released without a connection loss as well, eg. after a request timed out
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+		GameAnalyticsDatabase database;
+		TEST_CHECK(database.Initialize(DatabaseFile, DurabilityProfile::Balanced) == Result::Ok);
+
+		HybridEventStore hybridEventStore;
+		hybridEventStore.Initialize(&database, 100);
+		TEST_CHECK(hybridEventStore.SetConnected(true));
+		isPassed = CheckUnansweredBatch(hybridEventStore);
+	}
+	GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+	TEST_CHECK(isPassed);
+	return true;
+}
+
+bool Tests::SpillInOrder()
+{
+	std::string json;
+	{
+		GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+		GameAnalyticsDatabase database;
+		TEST_CHECK(database.Initialize(DatabaseFile, DurabilityProfile::Balanced) == Result::Ok);
+
+		HybridEventStore hybridEventStore;
+		hybridEventStore.Initialize(&database, 100);
+		TEST_CHECK(hybridEventStore.SetConnected(true));
+		TEST_CHECK(AddEvents(hybridEventStore, 8));
+
+		// Batches that are released in another order than they were leased, and one that is still being sent
+		TEST_CHECK(hybridEventStore.LeaseEvents(1, 2));
+		TEST_CHECK(hybridEventStore.LeaseEvents(2, 2));
+		TEST_CHECK(hybridEventStore.LeaseEvents(3, 2));
+		TEST_CHECK(hybridEventStore.ReleaseEvents(3));
+		TEST_CHECK(hybridEventStore.ReleaseEvents(1));
+		TEST_CHECK(hybridEventStore.Spill());
+		TEST_CHECK(!hybridEventStore.HasLeasedEvents(2));
+
+		TEST_CHECK(database.LeaseEvents(4, 10));
+		TEST_CHECK(database.RetrieveLeasedEvents(4, json, 0));
+	}
+	GameAnalyticsDatabase::DeleteDatabaseFiles(DatabaseFile);
+
+	// The events of the batch that was being sent are dropped
+	std::string expectedJson;
+	const int values[] = { 0, 1, 4, 5, 6, 7 };
+	for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+	{
+		expectedJson += expectedJson.empty() ? '[' : ',';
+		expectedJson += "{\"v\":2,\"user_id\":\"user\",\"client_ts\":" + std::to_string(1500000000 + values[i]) +
+			",\"category\":\"design\",\"event_id\":\"GamePlay:Kill:AlienSmurf\",\"value\":" + std::to_string(values[i]) + "}";
+	}
+	expectedJson += ']';
+	TEST_CHECK(json == expectedJson);
+	return true;
+}
@@ -0,0 +1,19 @@
+#include "Tests.h"
+
+#include "EventWriter.h"
+
+using namespace Analytics;
+
+bool Tests::EscapeKeys()
+{
+	// Keys that EventEncoder doesn't know are stored with the event, so they can be anything
+	EventWriter writer;
+	writer.BeginObject();
+	writer.WriteInt("event_id", 1);
+	writer.WriteInt("say \"hi\"\n", 2);
+	writer.WriteString("back\\slash", "value");
+	writer.EndObject();
+
+	TEST_CHECK(writer.GetBuffer() == "{\"event_id\":1,\"say \\\"hi\\\"\\n\":2,\"back\\\\slash\":\"value\"}");
+	return true;
+}
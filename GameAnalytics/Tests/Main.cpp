@@ -0,0 +1,33 @@
+#include "Tests.h"
+
+namespace
+{
+	struct Test
+	{
+		const char* name;
+		bool (*function)();
+	};
+
+	const Test tests[] =
+	{
+		{ "UpgradeBaselineSessionEnd", &Tests::UpgradeBaselineSessionEnd },
+		{ "UpgradeBaselineEvents", &Tests::UpgradeBaselineEvents },
+		{ "KeepUnansweredBatches", &Tests::KeepUnansweredBatches },
+		{ "SpillInOrder", &Tests::SpillInOrder },
+		{ "EscapeKeys", &Tests::EscapeKeys },
+	};
+}
+
+int main()
+{
+	int numFailed = 0;
+	for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); ++i)
+	{
+		const bool isPassed = tests[i].function();
+		printf("%s: %s\n", tests[i].name, isPassed ? "passed" : "FAILED");
+		if (!isPassed)
+			++numFailed;
+	}
+
+	return (numFailed == 0) ? 0 : 1;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstdio>
+
+// Fails the calling test when the condition doesn't hold, so the remaining checks of that test are skipped
+#define TEST_CHECK(condition) \
+	do \
+	{ \
+		if (!(condition)) \
+		{ \
+			printf("%s(%d): check failed: %s\n", __FILE__, __LINE__, #condition); \
+			return false; \
+		} \
+	} while (false)
+
+namespace Tests
+{
+	// Every test returns whether all its checks passed
+	bool UpgradeBaselineSessionEnd();
+	bool UpgradeBaselineEvents();
+	bool KeepUnansweredBatches();
+	bool SpillInOrder();
+	bool EscapeKeys();
+}